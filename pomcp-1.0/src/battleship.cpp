@@ -90,6 +90,12 @@ void BATTLESHIP::FreeState(STATE* state) const
     MemoryPool.Free(bsstate);
 }
 
+void BATTLESHIP::TrimMemory() const
+{
+    MemoryPool.Trim();
+    SIMULATOR::TrimMemory();
+}
+
 bool BATTLESHIP::Step(STATE& state, int action,
     int& observation, double& reward, STATUS& status) const
 {
@@ -189,7 +195,7 @@ bool BATTLESHIP::MoveShips(BATTLESHIP_STATE& bsstate) const
 {
     // Number of ships to move
     int numMoves = Random(1, 4);
-    static vector<int> shipIndices;
+    static thread_local vector<int> shipIndices;
     shipIndices.clear();
 
     for (int move = 0; move < numMoves; ++move)
@@ -6,6 +6,7 @@ using namespace UTILS;
 
 BELIEF_STATE::BELIEF_STATE()
 //: 	TotalRewardWeight(0.0)
+:   Locked(false)
 {
     Samples.clear();
     RewardSamples.clear();
@@ -60,6 +61,14 @@ void BELIEF_STATE::AddSample(STATE* state)
     Samples.push_back(state);
 }
 
+void BELIEF_STATE::AtomicAddSample(STATE* state)
+{
+    while (__atomic_test_and_set(&Locked, __ATOMIC_ACQUIRE))
+        ;
+    Samples.push_back(state);
+    __atomic_clear(&Locked, __ATOMIC_RELEASE);
+}
+
 void BELIEF_STATE::AddRewardSample(REWARD_TEMPLATE* reward)
 {
     RewardSamples.push_back(reward);
@@ -69,7 +78,14 @@ void BELIEF_STATE::AddRewardSample(REWARD_TEMPLATE* reward)
 void BELIEF_STATE::SetRewardSample(double value, const int& index)
 {
     //TotalRewardWeight = TotalRewardWeight - RewardSamples[index]->RewardWeight + rewardTemplate->RewardWeight;
-    RewardSamples[index]->RewardValue = value;
+    __atomic_store(&RewardSamples[index]->RewardValue, &value, __ATOMIC_RELAXED);
+}
+
+double BELIEF_STATE::GetRewardValue(const int& index) const
+{
+    double value;
+    __atomic_load(&RewardSamples[index]->RewardValue, &value, __ATOMIC_RELAXED);
+    return value;
 }
 
 
@@ -103,3 +119,9 @@ void BELIEF_STATE::Move(BELIEF_STATE& beliefs)
     beliefs.RewardSamples.clear();
     //beliefs.TotalRewardWeight = 0.0;
 }
+
+void BELIEF_STATE::MoveSamples(BELIEF_STATE& beliefs)
+{
+    Samples.insert(Samples.end(), beliefs.Samples.begin(), beliefs.Samples.end());
+    beliefs.Samples.clear();
+}
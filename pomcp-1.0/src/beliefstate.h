@@ -24,6 +24,9 @@ public:
 
     // Added state is owned by belief state
     void AddSample(STATE* state);
+    // For search threads sharing a tree. Only threads adding to the same
+    // node wait, on that node's spin lock, and only for the push.
+    void AtomicAddSample(STATE* state);
     
     //Same for rewards
     void AddRewardSample(REWARD_TEMPLATE* reward);
@@ -34,12 +37,18 @@ public:
     // Move all samples into this belief state
     void Move(BELIEF_STATE& beliefs);
 
+    // Move state samples only, leaving reward samples behind
+    void MoveSamples(BELIEF_STATE& beliefs);
+
     bool Empty() const { return Samples.empty(); }
     bool EmptyRewards() const { return RewardSamples.empty(); }
     int GetNumSamples() const { return Samples.size(); }
     int GetNumRewardSamples() const { return RewardSamples.size(); }
     const STATE* GetSample(int index) const { return Samples[index]; }
     const REWARD_TEMPLATE* GetRewardSample(int index) const { return RewardSamples[index]; }
+    // Reward values are read and set atomically, as tree parallel workers
+    // all learn the reward of the shared root
+    double GetRewardValue(const int& index) const;
     void SetRewardSample(double value, const int& index);
     
     //Rewards
@@ -48,6 +57,7 @@ private:
 
     std::vector<STATE*> Samples;
     std::vector<REWARD_TEMPLATE*> RewardSamples;
+    bool Locked;
     //double TotalRewardWeight;
 };
 
@@ -0,0 +1,552 @@
+#include "battleship.h"
+#include "boxpushing.h"
+#include "kitchen.h"
+#include "mcts.h"
+#include "network.h"
+#include "pocman.h"
+#include "rocksample.h"
+#include "tag.h"
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <thread>
+
+using namespace std;
+using namespace boost::program_options;
+using namespace UTILS;
+
+//----------------------------------------------------------------------------
+// Throughput of the simulators and of search, for each domain, written as
+// JSON. Every measurement starts from the same seed, and is repeated over a
+// number of trials to give a 95% confidence interval. Results can be checked
+// against a baseline written by an earlier run.
+//
+// The scaling mode instead times search on one domain for each number of
+// threads up to a maximum, over a set of simulation budgets.
+
+struct BENCH_PARAMS
+{
+    BENCH_PARAMS();
+
+    int Seed;
+    double MinTime; // seconds per throughput measurement
+    int NumSimulations;
+    int NumDecisions; // searches and updates per domain
+    int NumTrials;
+    double Tolerance; // fraction a baseline measure may worsen by
+    int Size, Number; // as for main, 0 for each domain's standard size
+    int MaxThreads;
+    bool TreeParallel;
+    vector<int> Budgets; // simulations per search, for scaling
+};
+
+BENCH_PARAMS::BENCH_PARAMS()
+:   Seed(1),
+    MinTime(0.25),
+    NumSimulations(1024),
+    NumDecisions(10),
+    NumTrials(5),
+    Tolerance(0.1),
+    Size(0),
+    Number(0),
+    MaxThreads(max(1, (int) thread::hardware_concurrency())),
+    TreeParallel(false)
+{
+}
+
+// Each measure is a statistic over trials
+struct BENCH_RESULTS
+{
+    STATISTIC StepRate;
+    STATISTIC CopyFreeRate;
+    STATISTIC LegalRate;
+    STATISTIC PreferredRate;
+    STATISTIC SimulationRate;
+    STATISTIC PeakTreeNodes;
+    STATISTIC NodeBytes;
+    STATISTIC UpdateLatency; // mean of each trial's updates
+    STATISTIC MaxUpdateLatency;
+};
+
+// Measures compared against the baseline, and whether larger is better
+struct BENCH_MEASURE
+{
+    const char* Name;
+    STATISTIC BENCH_RESULTS::*Stat;
+    bool Larger;
+};
+
+static const BENCH_MEASURE Measures[] = {
+    { "simulations_per_sec", &BENCH_RESULTS::SimulationRate, true },
+    { "peak_tree_nodes", &BENCH_RESULTS::PeakTreeNodes, false },
+    { "bytes_per_vnode", &BENCH_RESULTS::NodeBytes, false },
+    { "update_seconds", &BENCH_RESULTS::UpdateLatency, false } };
+static const int NumMeasures = sizeof(Measures) / sizeof(Measures[0]);
+
+static const char* Domains[] = { "rocksample", "tag", "pocman", "battleship",
+    "network", "boxpushing", "kitchen" };
+
+static SIMULATOR* CreateDomain(const string& name, const BENCH_PARAMS& params,
+    MCTS::PARAMS& searchParams)
+{
+    // Standard sizes unless given, with the search settings that main uses
+    int size = params.Size, number = params.Number;
+    if (name == "rocksample")
+        return new ROCKSAMPLE(size ? size : 7, number ? number : 8);
+    if (name == "tag")
+        return new TAG(number ? number : 1);
+    if (name == "pocman")
+        return new FULL_POCMAN;
+    if (name == "battleship")
+        return new BATTLESHIP(size ? size : 10, size ? size : 10, number ? number : 5);
+    if (name == "network")
+        return new NETWORK(size ? size : 10, number ? number : 1);
+    if (name == "boxpushing")
+    {
+        searchParams.UseTransforms = true;
+        return new BOXPUSHING(2, 0.0);
+    }
+    if (name == "kitchen")
+    {
+        searchParams.UseTransforms = false;
+        return new KITCHEN(true, false);
+    }
+    return 0;
+}
+
+static double Elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Calls op in batches until minTime has passed, and returns calls per second
+template<class OP>
+static double Throughput(OP op, double minTime)
+{
+    const int batch = 100;
+    long long calls = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double elapsed;
+    do
+    {
+        for (int i = 0; i < batch; i++)
+            op();
+        calls += batch;
+        elapsed = Elapsed(start);
+    }
+    while (elapsed < minTime);
+    return calls / elapsed;
+}
+
+static void BenchSimulator(const SIMULATOR& simulator, const BENCH_PARAMS& params,
+    BENCH_RESULTS& results)
+{
+    SIMULATOR::STATUS status;
+    int observation;
+    double reward;
+
+    // Rollout steps, starting again after each terminal step. Some domains
+    // only accept legal actions, so these are chosen as rollouts choose them.
+    RandomSeed(params.Seed);
+    STATE* state = simulator.CreateStartState();
+    HISTORY history;
+    results.StepRate.Add(Throughput([&]()
+    {
+        int action = simulator.SelectRandom(*state, history, status, 0);
+        if (simulator.Step(*state, action, observation, reward, status))
+        {
+            simulator.FreeState(state);
+            state = simulator.CreateStartState();
+            history.Clear();
+        }
+        else
+            history.Add(action, observation);
+    }, params.MinTime));
+    simulator.FreeState(state);
+
+    RandomSeed(params.Seed);
+    state = simulator.CreateStartState();
+    results.CopyFreeRate.Add(Throughput([&]()
+    {
+        simulator.FreeState(simulator.Copy(*state));
+    }, params.MinTime));
+
+    // Action generators may look at the last step, so take one first
+    history.Clear();
+    int action = simulator.SelectRandom(*state, history, status, 0);
+    simulator.Step(*state, action, observation, reward, status);
+    history.Add(action, observation);
+    vector<int> actions;
+    RandomSeed(params.Seed);
+    results.LegalRate.Add(Throughput([&]()
+    {
+        actions.clear();
+        simulator.GenerateLegal(*state, history, actions, status);
+    }, params.MinTime));
+    RandomSeed(params.Seed);
+    results.PreferredRate.Add(Throughput([&]()
+    {
+        actions.clear();
+        simulator.GeneratePreferred(*state, history, actions, status);
+    }, params.MinTime));
+    simulator.FreeState(state);
+}
+
+// Search settings for a budget, chosen as main chooses them
+static void SetBudget(const SIMULATOR& simulator, int numSimulations,
+    MCTS::PARAMS& searchParams)
+{
+    searchParams.NumSimulations = numSimulations;
+    searchParams.NumStartStates = numSimulations;
+    searchParams.NumTransforms = max(1, numSimulations / 16);
+    searchParams.MaxAttempts = searchParams.NumTransforms * 1000;
+    searchParams.MaxDepth = simulator.GetHorizon(0.01, 20);
+    searchParams.ExplorationConstant = simulator.GetRewardRange();
+}
+
+static void BenchSearch(const SIMULATOR& real, const SIMULATOR& simulator,
+    MCTS::PARAMS searchParams, const BENCH_PARAMS& params, BENCH_RESULTS& results)
+{
+    SetBudget(simulator, params.NumSimulations, searchParams);
+
+    RandomSeed(params.Seed);
+    MCTS mcts(simulator, searchParams);
+    STATE* state = real.CreateStartState();
+    long long simulations = 0;
+    double searchTime = 0;
+    int peakNodes = 0;
+    STATISTIC updateLatency;
+    for (int t = 0; t < params.NumDecisions; t++)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        int action = mcts.SelectAction(0);
+        searchTime += Elapsed(start);
+        simulations += mcts.GetSimulationCount(0);
+        peakNodes = max(peakNodes, mcts.GetTreeSize(0));
+
+        int observation;
+        double reward;
+        SIMULATOR::STATUS status = mcts.GetStatus(0);
+        bool terminal = real.Step(*state, action, observation, reward, status);
+
+        start = chrono::steady_clock::now();
+        bool consistent = mcts.Update(action, observation, reward, 0);
+        updateLatency.Add(Elapsed(start));
+        if (terminal || !consistent)
+            break;
+    }
+    real.FreeState(state);
+    results.SimulationRate.Add(simulations / searchTime);
+    results.PeakTreeNodes.Add(peakNodes);
+    results.NodeBytes.Add(mcts.GetNodeBytes(0));
+    results.UpdateLatency.Add(updateLatency.GetMean());
+    results.MaxUpdateLatency.Add(updateLatency.GetMax());
+}
+
+// 95% confidence interval half width, over trials
+static double Confidence(const STATISTIC& stat)
+{
+    return stat.GetCount() > 1 ? 1.96 * stat.GetStdErr() : 0;
+}
+
+static void WriteMeasure(const char* name, const STATISTIC& stat, ostream& ostr)
+{
+    ostr << ", \"" << name << "\": " << stat.GetMean()
+        << ", \"" << name << "_ci\": " << Confidence(stat);
+}
+
+static void WriteResults(const string& domain, const BENCH_RESULTS& results,
+    bool last, ostream& ostr)
+{
+    ostr << "    {\"domain\": \"" << domain << "\"";
+    WriteMeasure("steps_per_sec", results.StepRate, ostr);
+    WriteMeasure("copy_free_per_sec", results.CopyFreeRate, ostr);
+    WriteMeasure("legal_per_sec", results.LegalRate, ostr);
+    WriteMeasure("preferred_per_sec", results.PreferredRate, ostr);
+    for (int m = 0; m < NumMeasures; m++)
+        WriteMeasure(Measures[m].Name, results.*Measures[m].Stat, ostr);
+    ostr << ", \"update_seconds_max\": " << results.MaxUpdateLatency.GetMax()
+        << "}" << (last ? "" : ",") << endl;
+}
+
+// Prints each measure beside its baseline, and returns the number that are
+// worse by more than the tolerance. Only differences that the confidence
+// intervals of both runs cannot explain are counted, so noisy runs give
+// wider intervals rather than false alarms.
+static int CompareResults(const string& domain, const BENCH_RESULTS& results,
+    const boost::property_tree::ptree& baseline, double tolerance)
+{
+    int regressions = 0;
+    for (int m = 0; m < NumMeasures; m++)
+    {
+        const BENCH_MEASURE& measure = Measures[m];
+        const STATISTIC& stat = results.*measure.Stat;
+        double mean = stat.GetMean(), ci = Confidence(stat);
+        double baseMean = baseline.get<double>(measure.Name, 0);
+        double baseCI = baseline.get<double>(string(measure.Name) + "_ci", 0);
+
+        bool regressed = measure.Larger ?
+            mean + ci < (baseMean - baseCI) * (1 - tolerance) :
+            mean - ci > (baseMean + baseCI) * (1 + tolerance);
+        if (regressed)
+            regressions++;
+
+        cout << domain << " " << measure.Name << ": " << mean << " +/- " << ci
+            << ", baseline " << baseMean << " +/- " << baseCI;
+        if (baseMean != 0)
+            cout << " (" << showpos << 100 * (mean - baseMean) / baseMean << noshowpos << "%)";
+        cout << (regressed ? " REGRESSION" : "") << endl;
+    }
+    return regressions;
+}
+
+//----------------------------------------------------------------------------
+
+struct SCALING_STEP
+{
+    int Action, Observation;
+    double Reward;
+};
+
+struct SCALING_RESULTS
+{
+    int NumThreads, NumSimulations;
+    double SimulationRate;
+    int NumDecisions, NumAgreements; // root actions that single threaded search chose
+    vector<long long> ThreadAllocations;
+};
+
+// Searches along one trajectory. Single threaded search plays the real
+// domain and records its steps, which searches with more threads replay,
+// so that all of them choose actions from the same histories.
+static void ScalingSearch(const SIMULATOR& real, const SIMULATOR& simulator,
+    MCTS::PARAMS searchParams, const BENCH_PARAMS& params,
+    vector<SCALING_STEP>& trajectory, SCALING_RESULTS& results)
+{
+    SetBudget(simulator, results.NumSimulations, searchParams);
+    searchParams.NumThreads = results.NumThreads;
+    searchParams.TreeParallel = params.TreeParallel;
+
+    RandomSeed(params.Seed);
+    MCTS mcts(simulator, searchParams);
+    bool record = results.NumThreads == 1;
+    STATE* state = record ? real.CreateStartState() : 0;
+    if (record)
+        trajectory.clear();
+    long long simulations = 0;
+    double searchTime = 0;
+    results.NumDecisions = results.NumAgreements = 0;
+    for (int t = 0; t < params.NumDecisions; t++)
+    {
+        if (!record && t == (int) trajectory.size())
+            break;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        int action = mcts.SelectAction(0);
+        searchTime += Elapsed(start);
+        simulations += mcts.GetSimulationCount(0);
+
+        SCALING_STEP step;
+        bool terminal = false;
+        if (record)
+        {
+            SIMULATOR::STATUS status = mcts.GetStatus(0);
+            step.Action = action;
+            terminal = real.Step(*state, action, step.Observation, step.Reward, status);
+            trajectory.push_back(step);
+        }
+        else
+            step = trajectory[t];
+        results.NumDecisions++;
+        if (action == step.Action)
+            results.NumAgreements++;
+
+        if (!mcts.Update(step.Action, step.Observation, step.Reward, 0) || terminal)
+        {
+            // Later steps cannot be replayed from the single threaded history
+            if (record)
+                trajectory.resize(t + 1);
+            break;
+        }
+    }
+    if (state)
+        real.FreeState(state);
+    results.SimulationRate = simulations / searchTime;
+    mcts.GetThreadAllocations(0, results.ThreadAllocations);
+}
+
+static void WriteScaling(const SCALING_RESULTS& results, double singleRate,
+    bool last, ostream& ostr)
+{
+    double speedup = results.SimulationRate / singleRate;
+    ostr << "    {\"simulations\": " << results.NumSimulations
+        << ", \"threads\": " << results.NumThreads
+        << ", \"simulations_per_sec\": " << results.SimulationRate
+        << ", \"speedup\": " << speedup
+        << ", \"efficiency\": " << speedup / results.NumThreads
+        << ", \"agreement\": " << (double) results.NumAgreements / results.NumDecisions
+        << ", \"thread_allocations\": [";
+    for (int i = 0; i < (int) results.ThreadAllocations.size(); i++)
+        ostr << (i ? ", " : "") << results.ThreadAllocations[i];
+    ostr << "]}" << (last ? "" : ",") << endl;
+
+    cout << results.NumSimulations << " simulations, " << results.NumThreads
+        << " threads: " << results.SimulationRate << " per second, speedup "
+        << speedup << ", agreement " << results.NumAgreements << "/"
+        << results.NumDecisions << endl;
+}
+
+static void BenchScaling(const string& domain, const BENCH_PARAMS& params, ostream& ostr)
+{
+    MCTS::PARAMS searchParams;
+    SIMULATOR* real = CreateDomain(domain, params, searchParams);
+    SIMULATOR* simulator = CreateDomain(domain, params, searchParams);
+
+    ostr << "{\n  \"domain\": \"" << domain << "\""
+        << ",\n  \"seed\": " << params.Seed
+        << ",\n  \"tree_parallel\": " << (params.TreeParallel ? "true" : "false")
+        << ",\n  \"scaling\": [" << endl;
+    for (int b = 0; b < (int) params.Budgets.size(); b++)
+    {
+        vector<SCALING_STEP> trajectory;
+        double singleRate = 0;
+        for (int n = 1; n <= params.MaxThreads; n++)
+        {
+            SCALING_RESULTS results;
+            results.NumThreads = n;
+            results.NumSimulations = params.Budgets[b];
+            ScalingSearch(*real, *simulator, searchParams, params, trajectory, results);
+            if (n == 1)
+                singleRate = results.SimulationRate;
+            WriteScaling(results, singleRate,
+                b + 1 == (int) params.Budgets.size() && n == params.MaxThreads, ostr);
+        }
+    }
+    ostr << "  ]\n}" << endl;
+    delete real;
+    delete simulator;
+}
+
+int main(int argc, char* argv[])
+{
+    BENCH_PARAMS params;
+    string problem = "all", outputfile = "bench.json", baselinefile;
+    bool scaling = false;
+
+    options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "produce help message")
+        ("problem", value<string>(&problem), "domain to benchmark, or all")
+        ("seed", value<int>(&params.Seed), "random seed for every measurement")
+        ("mintime", value<double>(&params.MinTime), "seconds per throughput measurement")
+        ("simulations", value<int>(&params.NumSimulations), "simulations per search")
+        ("decisions", value<int>(&params.NumDecisions), "searches and updates per domain")
+        ("trials", value<int>(&params.NumTrials), "repeats of every measurement")
+        ("outputfile", value<string>(&outputfile), "JSON results file")
+        ("baseline", value<string>(&baselinefile), "JSON results file to check against")
+        ("tolerance", value<double>(&params.Tolerance), "fraction by which a baseline measure may worsen")
+        ("size", value<int>(&params.Size), "size of problem (problem specific)")
+        ("number", value<int>(&params.Number), "number of elements in problem (problem specific)")
+        ("scaling", value<bool>(&scaling), "time search on one problem for each number of threads")
+        ("maxthreads", value<int>(&params.MaxThreads), "most search threads to time when scaling")
+        ("budgets", value<vector<int> >(&params.Budgets)->multitoken(), "simulations per search when scaling")
+        ("treeparallel", value<bool>(&params.TreeParallel), "search threads share one tree when scaling")
+        ;
+
+    variables_map vm;
+    store(parse_command_line(argc, argv, desc), vm);
+    notify(vm);
+
+    if (vm.count("help"))
+    {
+        cout << desc << "\n";
+        return 1;
+    }
+
+    vector<string> domains;
+    for (int i = 0; i < (int) (sizeof(Domains) / sizeof(Domains[0])); i++)
+        if (problem == "all" || problem == Domains[i])
+            domains.push_back(Domains[i]);
+    if (domains.empty())
+    {
+        cout << "Unknown problem" << endl;
+        return 1;
+    }
+    if (scaling && domains.size() != 1)
+    {
+        cout << "Scaling needs a single problem" << endl;
+        return 1;
+    }
+    if (params.Budgets.empty())
+        params.Budgets.push_back(params.NumSimulations);
+
+    map<string, boost::property_tree::ptree> baselines;
+    if (!baselinefile.empty())
+    {
+        boost::property_tree::ptree baseline;
+        try
+        {
+            boost::property_tree::read_json(baselinefile, baseline);
+        }
+        catch (const boost::property_tree::json_parser_error& error)
+        {
+            cout << "Unable to read baseline: " << error.what() << endl;
+            return 1;
+        }
+        for (const auto& entry : baseline.get_child("domains", boost::property_tree::ptree()))
+            baselines[entry.second.get<string>("domain", "")] = entry.second;
+    }
+
+    // Some domains write to standard output, so results go to a file
+    ofstream ostr(outputfile.c_str());
+    if (!ostr)
+    {
+        cout << "Unable to open " << outputfile << endl;
+        return 1;
+    }
+
+    if (scaling)
+    {
+        BenchScaling(domains[0], params, ostr);
+        return 0;
+    }
+
+    ostr << "{\n  \"seed\": " << params.Seed
+        << ",\n  \"simulations\": " << params.NumSimulations
+        << ",\n  \"trials\": " << params.NumTrials
+        << ",\n  \"domains\": [" << endl;
+    int regressions = 0;
+    for (int i = 0; i < (int) domains.size(); i++)
+    {
+        MCTS::PARAMS searchParams;
+        SIMULATOR* real = CreateDomain(domains[i], params, searchParams);
+        SIMULATOR* simulator = CreateDomain(domains[i], params, searchParams);
+        BENCH_RESULTS results;
+        for (int trial = 0; trial < params.NumTrials; trial++)
+        {
+            BenchSimulator(*simulator, params, results);
+            BenchSearch(*real, *simulator, searchParams, params, results);
+        }
+        WriteResults(domains[i], results, i + 1 == (int) domains.size(), ostr);
+        if (!baselinefile.empty())
+        {
+            if (baselines.count(domains[i]))
+                regressions += CompareResults(domains[i], results, baselines[domains[i]], params.Tolerance);
+            else
+                cout << domains[i] << ": no baseline" << endl;
+        }
+        delete real;
+        delete simulator;
+    }
+    ostr << "  ]\n}" << endl;
+
+    if (regressions > 0)
+    {
+        cout << regressions << " regressions beyond " << 100 * params.Tolerance << "%" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -4,8 +4,6 @@
 using namespace std;
 using namespace UTILS;
 
-boost::math::beta_distribution<> beta(0.9,0.9);
-
 BOXPUSHING::BOXPUSHING(int numsmallboxes, double probLargeAgentBox)
 : XSize(4),
   YSize(3),
@@ -31,10 +29,8 @@ BOXPUSHING::BOXPUSHING(int numsmallboxes, double probLargeAgentBox)
     RewardRange = 99.9;
     Discount = 1.0;
     
-    quantiles.clear();
-    
-    for (int i = 0; i < 100; i++)
-	quantiles.push_back(boost::math::quantile(beta, RandomDouble(0.0, 1.0)));
+    quantiles.resize(100);
+    Beta(quantiles, 0.9, 0.9);
     
     /*MultiAgentLabels.clear();
     for (int i = 0; i < NumAgentActions; i++)
@@ -70,7 +66,7 @@ void BOXPUSHING::Validate(const STATE& state) const
 {
     const BOXPUSHING_STATE& bpstate = safe_cast<const BOXPUSHING_STATE&>(state);
     for (int i = 0; i < (int) bpstate.Agents.size(); i++)
-	assert(Inside(bpstate.Agents[i].Position));
+	assert(bpstate.Cells.Inside(bpstate.Agents[i].Position));
 }
 
 STATE* BOXPUSHING::CreateStartState() const
@@ -154,6 +150,12 @@ void BOXPUSHING::FreeState(STATE* state) const
     MemoryPool.Free(bpstate);
 }
 
+void BOXPUSHING::TrimMemory() const
+{
+    MemoryPool.Trim();
+    SIMULATOR::TrimMemory();
+}
+
 bool BOXPUSHING::Step(STATE& state, int action,
     int& observation, double& reward, STATUS& status) const
 {
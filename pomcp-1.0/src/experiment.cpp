@@ -1,8 +1,17 @@
 #include "experiment.h"
-#include "boost/timer.hpp"
+#include <sstream>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 using namespace std;
 
+// Wall clock, as runs may share the process with other runs
+static double Elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
 EXPERIMENT::PARAMS::PARAMS()
 :   NumRuns(1000),
     NumSteps(20),
@@ -18,7 +27,14 @@ EXPERIMENT::PARAMS::PARAMS()
     Accuracy(0.01),
     UndiscountedHorizon(20),
     AutoExploration(true),
-    BreakOnTerminate(true)
+    BreakOnTerminate(true),
+    Seed(0),
+    NumRunThreads(1),
+    NumShards(1),
+    Shard(-1),
+    CheckpointInterval(60),
+    Resume(false),
+    StepLog("")
 {
     RandomActions.clear();
     
@@ -31,10 +47,15 @@ EXPERIMENT::EXPERIMENT(const SIMULATOR& real,
     EXPERIMENT::PARAMS& expParams, MCTS::PARAMS& searchParams)
 :   Real(real),
     Simulator(simulator),
-    OutputFile(outputFile.c_str()),
+    OutputName(outputFile),
     ExpParams(expParams),
     SearchParams(searchParams),
-    UpdatePlanStatistics(false)
+    UpdatePlanStatistics(false),
+    NumSweeps(0),
+    LastCheckpoint(chrono::steady_clock::now()),
+    Resumed(false),
+    ResumeSweep(0),
+    ResumeRuns(0)
 {
     Results.SuccessfulPlanCount.clear();
     Results.PlanSequenceReward.clear();
@@ -47,7 +68,28 @@ EXPERIMENT::EXPERIMENT(const SIMULATOR& real,
 	Results.PlanSequenceReward.push_back(s2);
 	STATISTIC s3;
 	Results.PlanSequenceLength.push_back(s3);
+	Results.SelectLatency.push_back(HISTOGRAM());
+	Results.UpdateLatency.push_back(HISTOGRAM());
+    }
+
+    // Shards leave the results file to the process that merges them
+    if (!IsShard())
+    {
+        Resumed = ExpParams.Resume && Checkpoints() && LoadCheckpoint();
+        if (Resumed)
+        {
+            OutputFile.open(outputFile.c_str(), ios::app);
+            OutputFile.seekp(0, ios::end);
+        }
+        else
+            OutputFile.open(outputFile.c_str());
     }
+
+    // Each shard logs to a file of its own
+    if (!ExpParams.StepLog.empty())
+        StepLog.reset(new STEP_LOG(IsShard() ? ExpParams.StepLog + ".shard"
+            + to_string(ExpParams.Shard) : ExpParams.StepLog));
+
     if (ExpParams.AutoExploration)
     {
         if (SearchParams.UseRave)
@@ -55,12 +97,11 @@ EXPERIMENT::EXPERIMENT(const SIMULATOR& real,
         else
             SearchParams.ExplorationConstant = simulator.GetRewardRange();
     }
-    MCTS::InitFastUCB(SearchParams.ExplorationConstant);
 }
 
-void EXPERIMENT::Run()
+void EXPERIMENT::Run(RESULTS& results, int sweep, int n)
 {
-    boost::timer timer;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
     
     MCTS mcts(Simulator, SearchParams);
     
@@ -99,12 +140,15 @@ void EXPERIMENT::Run()
 	double reward;
 	int action;
 	int action0 = 0, action1 = 0;
+	double latency0 = 0, latency1 = 0;
 	if (!SearchParams.MultiAgent)
-	    action = mcts.SelectAction(0);
+	{
+	    action = SelectAction(mcts, 0, results, latency0);
+	}
 	else
 	{
-	    action0 = mcts.SelectAction(1);
-	    action1 = mcts.SelectAction(2);
+	    action0 = SelectAction(mcts, 1, results, latency0);
+	    action1 = SelectAction(mcts, 2, results, latency1);
 	    /*if (SearchParams.RewardAdaptive[0] && !SearchParams.JointQActions[0])
 		action0 = Simulator.GetAgentAction(action0,1);
 	    if (SearchParams.RewardAdaptive[1] && !SearchParams.JointQActions[1])
@@ -115,13 +159,29 @@ void EXPERIMENT::Run()
 	status.JointGoalCount = 0;
 	terminal = Real.Step(*state, action, observation, reward, status);
 
-	Results.Reward.Add(reward);
+	results.Reward.Add(reward);
 	undiscountedReturn += reward;
 	discountedReturn += reward * discount;
 	discount *= Real.GetDiscount();
 	
 	jointGoalCount += status.JointGoalCount;
 	
+	if (StepLog)
+	{
+	    STEP_RECORD record;
+	    record.Sweep = sweep;
+	    record.Run = n;
+	    record.Step = t;
+	    record.Reward = reward;
+	    if (!SearchParams.MultiAgent)
+		LogStep(mcts, record, 0, action, observation, latency0);
+	    else
+	    {
+		LogStep(mcts, record, 1, action0, Simulator.GetAgentObservation(observation,1), latency0);
+		LogStep(mcts, record, 2, action1, Simulator.GetAgentObservation(observation,2), latency1);
+	    }
+	}
+	
 	if (UpdatePlanStatistics)
 	{
 	    if (!SearchParams.MultiAgent)
@@ -161,7 +221,7 @@ void EXPERIMENT::Run()
 
 	if (terminal)
 	{
-	    cout << "Terminated" << endl;
+	    ReportRun(n, "Terminated");
 	    if (ExpParams.BreakOnTerminate)
 		break;
 	    else
@@ -186,20 +246,22 @@ void EXPERIMENT::Run()
 	    break;
 	
 	if (!SearchParams.MultiAgent)
-	    outOfParticles = !mcts.Update(action, observation, reward, 0);
+	    outOfParticles = !Update(mcts, action, observation, reward, 0, results);
 	else
 	{
-	    outOfParticles = !mcts.Update(action0, Simulator.GetAgentObservation(observation,1), reward, 1);
-	    outOfParticles2 = !mcts.Update(action1, Simulator.GetAgentObservation(observation,2), reward, 2);
+	    outOfParticles = !Update(mcts, action0, Simulator.GetAgentObservation(observation,1), reward, 1, results);
+	    outOfParticles2 = !Update(mcts, action1, Simulator.GetAgentObservation(observation,2), reward, 2, results);
 	}
 	    
 	if (outOfParticles || outOfParticles2)
 	    break;
 
-	if (timer.elapsed() > ExpParams.TimeOut)
+	if (Elapsed(start) > ExpParams.TimeOut)
 	{
-	    cout << "Timed out after " << t << " steps in "
-		<< Results.Time.GetTotal() << "seconds" << endl;
+	    ostringstream message;
+	    message << "Timed out after " << t << " steps in "
+		<< Elapsed(start) << "seconds";
+	    ReportRun(n, message.str());
 	    break;
 	}
     }
@@ -207,9 +269,9 @@ void EXPERIMENT::Run()
     if (outOfParticles || outOfParticles2)
     {
 	if (outOfParticles)
-	    cout << "Out of particles, finishing episode with SelectRandom " << endl;
+	    ReportRun(n, "Out of particles, finishing episode with SelectRandom");
 	if (outOfParticles2)
-	    cout << "Out of particles 2, finishing episode with SelectRandom " << endl;
+	    ReportRun(n, "Out of particles 2, finishing episode with SelectRandom");
         HISTORY history = mcts.GetHistory(0);
 	HISTORY history2;
 	if (SearchParams.MultiAgent)
@@ -225,6 +287,7 @@ void EXPERIMENT::Run()
             // to avoid "cheating"
             int action;
 	    int action0 = 0, action1 = 0;
+	    double latency0 = 0, latency1 = 0;
 	    if (!SearchParams.MultiAgent)
 		action = Simulator.SelectRandom(*state, history, mcts.GetStatus(0), 0);
 	    else
@@ -237,7 +300,9 @@ void EXPERIMENT::Run()
 			action0 = Simulator.SelectRandom(*state, history, mcts.GetStatus(1), 1);
 		}
 		else
-		    action0 = mcts.SelectAction(1);
+		{
+		    action0 = SelectAction(mcts, 1, results, latency0);
+		}
 		if (outOfParticles2)
 		{
 		    if (SearchParams.JointQActions[1])
@@ -247,7 +312,9 @@ void EXPERIMENT::Run()
 		    
 		}
 		else
-		    action1 = mcts.SelectAction(2);
+		{
+		    action1 = SelectAction(mcts, 2, results, latency1);
+		}
 		
 		/*if (SearchParams.RewardAdaptive[0] && !SearchParams.JointQActions[0] && !outOfParticles)
 		    action0 = Simulator.GetAgentAction(action0,1);
@@ -260,13 +327,27 @@ void EXPERIMENT::Run()
 	    status.JointGoalCount = 0;
             terminal = Real.Step(*state, action, observation, reward, status);
 
-            Results.Reward.Add(reward);
+            results.Reward.Add(reward);
             undiscountedReturn += reward;
             discountedReturn += reward * discount;
             discount *= Real.GetDiscount();
 	    
 	    jointGoalCount += status.JointGoalCount;
 	    
+	    // Only agents that still search are logged
+	    if (StepLog && SearchParams.MultiAgent)
+	    {
+		STEP_RECORD record;
+		record.Sweep = sweep;
+		record.Run = n;
+		record.Step = t;
+		record.Reward = reward;
+		if (!outOfParticles)
+		    LogStep(mcts, record, 1, action0, Simulator.GetAgentObservation(observation,1), latency0);
+		if (!outOfParticles2)
+		    LogStep(mcts, record, 2, action1, Simulator.GetAgentObservation(observation,2), latency1);
+	    }
+	    
 	    if (UpdatePlanStatistics)
 	    {
 		if (SearchParams.MultiAgent)
@@ -302,7 +383,7 @@ void EXPERIMENT::Run()
 
             if (terminal)
             {
-                cout << "Terminated" << endl;
+                ReportRun(n, "Terminated");
 		if (ExpParams.BreakOnTerminate)
 		    break;
 		else
@@ -337,7 +418,7 @@ void EXPERIMENT::Run()
 			history.Add(action0, Simulator.GetAgentObservation(observation,1));
 		}
 		else
-		    outOfParticles = !mcts.Update(action0, Simulator.GetAgentObservation(observation,1), reward, 1);
+		    outOfParticles = !Update(mcts, action0, Simulator.GetAgentObservation(observation,1), reward, 1, results);
 		if (outOfParticles2)
 		{
 		    if (SearchParams.JointQActions[1])
@@ -346,18 +427,72 @@ void EXPERIMENT::Run()
 			history2.Add(action1, Simulator.GetAgentObservation(observation,2));
 		}
 		else
-		    outOfParticles2 = !mcts.Update(action1, Simulator.GetAgentObservation(observation,2), reward, 2);
+		    outOfParticles2 = !Update(mcts, action1, Simulator.GetAgentObservation(observation,2), reward, 2, results);
 	    }
         }
     }
 
-    Results.Time.Add(timer.elapsed()/(t > 0 ? t*1.0 : 1.0));
-    Results.UndiscountedReturn.Add(undiscountedReturn);
-    Results.DiscountedReturn.Add(discountedReturn);
-    Results.JointGoalCount.Add(jointGoalCount);
-    cout << "Discounted return = " << discountedReturn
+    results.Time.Add(Elapsed(start)/(t > 0 ? t*1.0 : 1.0));
+    results.UndiscountedReturn.Add(undiscountedReturn);
+    results.DiscountedReturn.Add(discountedReturn);
+    results.JointGoalCount.Add(jointGoalCount);
+	
+    if (UpdatePlanStatistics)
+    {
+	for (int i = 0; i < Real.GetNumAgents(); i++)
+	{
+	    results.SuccessfulPlanCount[i].Add((double) planCounts[i]);
+	    results.PlanSequenceReward[i].Add(planRewards[i].GetMean());
+	    results.PlanSequenceLength[i].Add((double) planLengths[i].GetMean());
+	}
+    }
+}
+
+int EXPERIMENT::SelectAction(MCTS& mcts, int index, RESULTS& results, double& latency) const
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int action = mcts.SelectAction(index);
+    latency = Elapsed(start);
+    results.SelectLatency[index == 0 ? index : index-1].Add(latency);
+    results.Simulations.Add(mcts.GetSimulationCount(index));
+    return action;
+}
+
+bool EXPERIMENT::Update(MCTS& mcts, int action, int observation, double reward,
+    int index, RESULTS& results) const
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool success = mcts.Update(action, observation, reward, index);
+    results.UpdateLatency[index == 0 ? index : index-1].Add(Elapsed(start));
+    return success;
+}
+
+void EXPERIMENT::ReportRun(int n, const string& message) const
+{
+    lock_guard<mutex> lock(ReportMutex);
+    cout << "Run " << n + 1 << ": " << message << endl;
+}
+
+void EXPERIMENT::LogStep(const MCTS& mcts, STEP_RECORD record, int index,
+    int action, int observation, double latency) const
+{
+    // Agents are numbered from 0, as in the results file
+    record.Agent = index == 0 ? index : index-1;
+    record.Action = action;
+    record.Observation = observation;
+    record.Simulations = mcts.GetSimulationCount(index);
+    record.TreeNodes = mcts.GetTreeSize(index);
+    record.Particles = mcts.BeliefState(index).GetNumSamples();
+    record.Latency = latency;
+    StepLog->Add(record);
+}
+
+bool EXPERIMENT::AddRun(const RESULTS& run, int n)
+{
+    Results.Merge(run);
+    cout << "Discounted return = " << run.DiscountedReturn.GetMean()
         << ", average = " << Results.DiscountedReturn.GetMean() << endl;
-    cout << "Undiscounted return = " << undiscountedReturn
+    cout << "Undiscounted return = " << run.UndiscountedReturn.GetMean()
         << ", average = " << Results.UndiscountedReturn.GetMean() << endl;
 	
     if (!ExpParams.BreakOnTerminate)
@@ -367,55 +502,133 @@ void EXPERIMENT::Run()
     {
 	for (int i = 0; i < Real.GetNumAgents(); i++)
 	{
-	    Results.SuccessfulPlanCount[i].Add((double) planCounts[i]);
-	    Results.PlanSequenceReward[i].Add(planRewards[i].GetMean());
-	    Results.PlanSequenceLength[i].Add((double) planLengths[i].GetMean());
-	    cout << "Successful Plan Count = " << planCounts[i]
+	    cout << "Successful Plan Count = " << run.SuccessfulPlanCount[i].GetMean()
 		<< ", average = " << Results.SuccessfulPlanCount[i].GetMean() << endl;
-	    cout << "Mean Plan Sequence Reward = " << planRewards[i].GetMean()
+	    cout << "Mean Plan Sequence Reward = " << run.PlanSequenceReward[i].GetMean()
 		<< ", average = " << Results.PlanSequenceReward[i].GetMean() << endl;
-	    cout << "Mean Plan Sequence Length = " << planLengths[i].GetMean() 
+	    cout << "Mean Plan Sequence Length = " << run.PlanSequenceLength[i].GetMean() 
 		<< ", average = " << Results.PlanSequenceLength[i].GetMean() << endl;
 	}
     }
+
+    if (Results.Time.GetTotal() > ExpParams.TimeOut)
+    {
+        cout << "Timed out after " << n << " runs in "
+            << Results.Time.GetTotal() << "seconds" << endl;
+        return false;
+    }
+    return true;
 }
 
 void EXPERIMENT::MultiRun()
 {
-    for (int n = 0; n < ExpParams.NumRuns; n++)
+    int sweep = NumSweeps++;
+    RESULTS empty = Results;
+    empty.Clear();
+    if (MergesShards())
     {
-        cout << "Starting run " << n + 1 << " with "
-            << SearchParams.NumSimulations << " simulations";
-	if (ExpParams.EnableRewardIterations)
-	    cout << " and " << SearchParams.NumLearnSimulations << " reward simulations";
-	cout << "... " << endl;
-        Run();
-        if (Results.Time.GetTotal() > ExpParams.TimeOut)
+        // Every shard's runs for this sweep are read, even after a time out
+        bool timedOut = false;
+        for (int n = 0; n < ExpParams.NumRuns; n++)
         {
-            cout << "Timed out after " << n << " runs in "
-                << Results.Time.GetTotal() << "seconds" << endl;
-            break;
+            RESULTS run = empty;
+            ReadShardRun(sweep, n, run);
+            if (!timedOut)
+                timedOut = !AddRun(run, n);
         }
+        return;
     }
+
+    // Runs are independent, each seeded from its own stream, so they can be
+    // played in any order. Finished runs are added to Results strictly in
+    // run order, which keeps the totals the same for any number of threads.
+    int first = IsShard() ? ExpParams.Shard : 0;
+    if (sweep == ResumeSweep && ResumeRuns > 0)
+    {
+        Results = ResumeResults;
+        first = ResumeRuns;
+    }
+    vector<int> runIds;
+    for (int n = first; n < ExpParams.NumRuns;
+        n += IsShard() ? ExpParams.NumShards : 1)
+        runIds.push_back(n);
+
+    int numThreads = ExpParams.NumRunThreads;
+    if (SearchParams.Verbose >= 1 || numThreads < 1)
+        numThreads = 1; // displays would interleave
+    numThreads = min(numThreads, (int) runIds.size());
+
+    vector<RESULTS> runs(runIds.size(), empty);
+    vector<bool> finished(runIds.size(), false);
+    int next = 0, added = 0;
+    bool timedOut = false;
+    mutex runMutex;
+
+    auto player = [&]()
+    {
+        for (;;)
+        {
+            int k, n;
+            {
+                lock_guard<mutex> lock(runMutex);
+                if (timedOut || next == (int) runIds.size())
+                    return;
+                k = next++;
+                n = runIds[k];
+                cout << "Starting run " << n + 1 << " with "
+                    << SearchParams.NumSimulations << " simulations";
+                if (ExpParams.EnableRewardIterations)
+                    cout << " and " << SearchParams.NumLearnSimulations << " reward simulations";
+                cout << "... " << endl;
+            }
+
+            UTILS::RandomSeed(ExpParams.Seed, n);
+            Run(runs[k], sweep, n);
+
+            lock_guard<mutex> lock(runMutex);
+            finished[k] = true;
+            while (!timedOut && added < (int) runIds.size() && finished[added])
+            {
+                // Shards leave time outs to the merge, which sees all runs
+                if (IsShard())
+                    WriteShardRun(sweep, runIds[added], runs[added]);
+                else
+                    timedOut = !AddRun(runs[added], runIds[added]);
+                if (!timedOut && Checkpoints()
+                    && Elapsed(LastCheckpoint) >= ExpParams.CheckpointInterval)
+                    SaveCheckpoint(sweep, runIds[added] + 1, Results);
+                added++;
+            }
+        }
+    };
+
+    if (numThreads <= 1)
+        player();
+    else
+    {
+        vector<thread> players;
+        for (int t = 0; t < numThreads; t++)
+            players.push_back(thread(player));
+        for (int t = 0; t < numThreads; t++)
+            players[t].join();
+    }
+
+    // Belief states of the finished runs are all free by now
+    Simulator.TrimMemory();
+    Real.TrimMemory();
 }
 
 void EXPERIMENT::DiscountedReturn()
 {
-    OutputFile.precision(4);
     cout << "Main runs" << endl;
-    if (!ExpParams.EnableRewardIterations)
-	OutputFile << "Simulations,Runs,Undiscounted return,Undiscounted error,Discounted return,Discounted error,Time,Joint Goal Count,";
-    else
-	OutputFile << "Simulations,Reward Simulations,Runs,Undiscounted return,Undiscounted error,Discounted return,Discounted error,Time,Joint Goal Count,";
-    
-    if (UpdatePlanStatistics)
-    {
-	for (int k = 0; k < Real.GetNumAgents(); k++)
-	    OutputFile << "Plan Count " << k << ",Error,Plan Reward " << k << ",Error,Plan Length " << k << ",Error,"; 
-    }
-    
-    OutputFile << "\n";
-    
+    if (IsShard())
+        OpenShardOutput();
+    if (MergesShards())
+        OpenShards();
+    OutputFile.precision(4);
+    if (!IsShard() && !Resumed)
+        WriteHeader();
+
     SearchParams.MaxDepth = Simulator.GetHorizon(ExpParams.Accuracy, ExpParams.UndiscountedHorizon);
     ExpParams.SimSteps = Simulator.GetHorizon(ExpParams.Accuracy, ExpParams.UndiscountedHorizon);
     //ExpParams.NumSteps = Real.GetHorizon(ExpParams.Accuracy, ExpParams.UndiscountedHorizon);
@@ -447,56 +660,128 @@ void EXPERIMENT::DiscountedReturn()
 	{
 	    //if (ExpParams.EnableRewardIterations)
 		//SearchParams.NumLearnSimulations = 1 << j;
+	    // Sweeps finished before resuming are already in the results file
+	    if (NumSweeps < ResumeSweep)
+	    {
+		NumSweeps++;
+		continue;
+	    }
 	    Results.Clear();
 	    MultiRun();
 
-	    cout << "Simulations = " << SearchParams.NumSimulations << endl;
-	    if (ExpParams.EnableRewardIterations)
-		cout << "Reward Simulations = " << SearchParams.NumLearnSimulations << endl;
-	    cout << "Runs = " << Results.Time.GetCount() << endl
-		<< "Undiscounted return = " << Results.UndiscountedReturn.GetMean()
-		<< " +- " << Results.UndiscountedReturn.GetStdErr() << endl
-		<< "Discounted return = " << Results.DiscountedReturn.GetMean()
-		<< " +- " << Results.DiscountedReturn.GetStdErr() << endl
-		<< "Time = " << Results.Time.GetMean() << endl
-		<< "Joint goal count = " << Results.JointGoalCount.GetTotal() << endl;
-	    if (UpdatePlanStatistics)
+	    if (!IsShard())
+		WriteResults();
+	    if (Checkpoints())
 	    {
-		for (int k = 0; k < Real.GetNumAgents(); k++)
-		{
-		    cout << "Mean Successful Plan Count = " << Results.SuccessfulPlanCount[k].GetMean() 
-			<< " +- " << Results.SuccessfulPlanCount[k].GetStdErr() << endl;
-		    cout << "Mean Plan Sequence Reward = " << Results.PlanSequenceReward[k].GetMean() 
-			<< " +- " << Results.PlanSequenceReward[k].GetStdErr() << endl;
-		    cout << "Mean Plan Sequence Length = " << Results.PlanSequenceLength[k].GetMean() 
-			<< " +- " << Results.PlanSequenceLength[k].GetStdErr() << endl;
-		}
+		RESULTS empty = Results;
+		empty.Clear();
+		SaveCheckpoint(NumSweeps, 0, empty);
 	    }
-	    OutputFile << SearchParams.NumSimulations << ",";
-	    if (ExpParams.EnableRewardIterations)
-		OutputFile << SearchParams.NumLearnSimulations << ",";
-	    OutputFile << Results.Time.GetCount() << ","
-		<< Results.UndiscountedReturn.GetMean() << ","
-		<< Results.UndiscountedReturn.GetStdErr() << ","
-		<< Results.DiscountedReturn.GetMean() << ","
-		<< Results.DiscountedReturn.GetStdErr() << ","
-		<< Results.Time.GetMean() << ","
-		<< Results.JointGoalCount.GetTotal() << ",";
-	    if (UpdatePlanStatistics)
-	    {
-		for (int k = 0; k < Real.GetNumAgents(); k++)
-		{
-		    OutputFile << Results.SuccessfulPlanCount[k].GetMean() << ","
-			<< Results.SuccessfulPlanCount[k].GetStdErr() << ","
-			<< Results.PlanSequenceReward[k].GetMean() << ","
-			<< Results.PlanSequenceReward[k].GetStdErr() << ","
-			<< Results.PlanSequenceLength[k].GetMean() << ","
-			<< Results.PlanSequenceLength[k].GetStdErr() << ",";
-		}
-	    }
-	    OutputFile << endl;
 	}
     }
+
+    if (IsShard())
+        ShardOutput.close();
+    if (MergesShards())
+        CloseShards();
+    if (Checkpoints())
+        remove(CheckpointName().c_str());
+}
+
+void EXPERIMENT::WriteHeader()
+{
+    if (!ExpParams.EnableRewardIterations)
+	OutputFile << "Simulations,Runs,Undiscounted return,Undiscounted error,Discounted return,Discounted error,Time,";
+    else
+	OutputFile << "Simulations,Reward Simulations,Runs,Undiscounted return,Undiscounted error,Discounted return,Discounted error,Time,";
+    for (int k = 0; k < GetNumSearchAgents(); k++)
+	OutputFile << "Select p50 " << k << ",Select p90 " << k << ",Select p99 " << k << ",Select max " << k
+	    << ",Update p50 " << k << ",Update p90 " << k << ",Update p99 " << k << ",Update max " << k << ",";
+    OutputFile << "Joint Goal Count,";
+
+    if (SearchParams.TimeLimit > 0)
+	OutputFile << "Search Simulations,Error,";
+    
+    if (UpdatePlanStatistics)
+    {
+	for (int k = 0; k < Real.GetNumAgents(); k++)
+	    OutputFile << "Plan Count " << k << ",Error,Plan Reward " << k << ",Error,Plan Length " << k << ",Error,"; 
+    }
+    
+    OutputFile << "\n";
+}
+
+void EXPERIMENT::WriteResults()
+{
+    cout << "Simulations = " << SearchParams.NumSimulations << endl;
+    if (ExpParams.EnableRewardIterations)
+	cout << "Reward Simulations = " << SearchParams.NumLearnSimulations << endl;
+    cout << "Runs = " << Results.Time.GetCount() << endl
+	<< "Undiscounted return = " << Results.UndiscountedReturn.GetMean()
+	<< " +- " << Results.UndiscountedReturn.GetStdErr() << endl
+	<< "Discounted return = " << Results.DiscountedReturn.GetMean()
+	<< " +- " << Results.DiscountedReturn.GetStdErr() << endl
+	<< "Time = " << Results.Time.GetMean() << endl;
+    for (int k = 0; k < GetNumSearchAgents(); k++)
+    {
+	const HISTOGRAM& select = Results.SelectLatency[k];
+	const HISTOGRAM& update = Results.UpdateLatency[k];
+	cout << "Select latency " << k << " p50/p90/p99/max = " << select.GetQuantile(0.5) << " / "
+	    << select.GetQuantile(0.9) << " / " << select.GetQuantile(0.99) << " / " << select.GetMax() << endl
+	    << "Update latency " << k << " p50/p90/p99/max = " << update.GetQuantile(0.5) << " / "
+	    << update.GetQuantile(0.9) << " / " << update.GetQuantile(0.99) << " / " << update.GetMax() << endl;
+    }
+    cout << "Joint goal count = " << Results.JointGoalCount.GetTotal() << endl;
+    if (SearchParams.TimeLimit > 0)
+	cout << "Simulations per search = " << Results.Simulations.GetMean()
+	    << " +- " << Results.Simulations.GetStdErr() << endl;
+    if (UpdatePlanStatistics)
+    {
+	for (int k = 0; k < Real.GetNumAgents(); k++)
+	{
+	    cout << "Mean Successful Plan Count = " << Results.SuccessfulPlanCount[k].GetMean() 
+		<< " +- " << Results.SuccessfulPlanCount[k].GetStdErr() << endl;
+	    cout << "Mean Plan Sequence Reward = " << Results.PlanSequenceReward[k].GetMean() 
+		<< " +- " << Results.PlanSequenceReward[k].GetStdErr() << endl;
+	    cout << "Mean Plan Sequence Length = " << Results.PlanSequenceLength[k].GetMean() 
+		<< " +- " << Results.PlanSequenceLength[k].GetStdErr() << endl;
+	}
+    }
+    OutputFile << SearchParams.NumSimulations << ",";
+    if (ExpParams.EnableRewardIterations)
+	OutputFile << SearchParams.NumLearnSimulations << ",";
+    OutputFile << Results.Time.GetCount() << ","
+	<< Results.UndiscountedReturn.GetMean() << ","
+	<< Results.UndiscountedReturn.GetStdErr() << ","
+	<< Results.DiscountedReturn.GetMean() << ","
+	<< Results.DiscountedReturn.GetStdErr() << ","
+	<< Results.Time.GetMean() << ",";
+    for (int k = 0; k < GetNumSearchAgents(); k++)
+    {
+	const HISTOGRAM& select = Results.SelectLatency[k];
+	const HISTOGRAM& update = Results.UpdateLatency[k];
+	OutputFile << select.GetQuantile(0.5) << "," << select.GetQuantile(0.9) << ","
+	    << select.GetQuantile(0.99) << "," << select.GetMax() << ","
+	    << update.GetQuantile(0.5) << "," << update.GetQuantile(0.9) << ","
+	    << update.GetQuantile(0.99) << "," << update.GetMax() << ",";
+    }
+    OutputFile << Results.JointGoalCount.GetTotal() << ",";
+    if (SearchParams.TimeLimit > 0)
+	OutputFile << Results.Simulations.GetMean() << ","
+	    << Results.Simulations.GetStdErr() << ",";
+    if (UpdatePlanStatistics)
+    {
+	for (int k = 0; k < Real.GetNumAgents(); k++)
+	{
+	    OutputFile << Results.SuccessfulPlanCount[k].GetMean() << ","
+		<< Results.SuccessfulPlanCount[k].GetStdErr() << ","
+		<< Results.PlanSequenceReward[k].GetMean() << ","
+		<< Results.PlanSequenceReward[k].GetStdErr() << ","
+		<< Results.PlanSequenceLength[k].GetMean() << ","
+		<< Results.PlanSequenceLength[k].GetStdErr() << ",";
+	}
+    }
+    OutputFile << endl;
 }
 
 void EXPERIMENT::AverageReward()
@@ -518,7 +803,9 @@ void EXPERIMENT::AverageReward()
         SearchParams.MaxAttempts = SearchParams.NumTransforms * ExpParams.TransformAttempts;
 
         Results.Clear();
-        Run();
+        RESULTS run = Results;
+        Run(run);
+        AddRun(run, 0);
 
         cout << "Simulations = " << SearchParams.NumSimulations << endl
             << "Steps = " << Results.Reward.GetCount() << endl
@@ -534,3 +821,234 @@ void EXPERIMENT::AverageReward()
 }
 
 //----------------------------------------------------------------------------
+
+string EXPERIMENT::ShardName(const string& outputFile, int shard)
+{
+    return outputFile + ".shard" + to_string(shard);
+}
+
+void EXPERIMENT::RemoveShards(const string& outputFile, int numShards)
+{
+    for (int k = 0; k < numShards; k++)
+        remove(ShardName(outputFile, k).c_str());
+}
+
+// Opened before any run, so that a shard with no runs still leaves a file
+void EXPERIMENT::OpenShardOutput()
+{
+    ShardOutput.open(ShardName(OutputName, ExpParams.Shard).c_str(), ios::binary);
+    if (!ShardOutput)
+    {
+        cout << "Cannot write shard file " << ShardName(OutputName, ExpParams.Shard) << endl;
+        exit(1);
+    }
+}
+
+void EXPERIMENT::OpenShards()
+{
+    ShardInputs.clear();
+    for (int k = 0; k < ExpParams.NumShards; k++)
+    {
+        ShardInputs.push_back(unique_ptr<ifstream>(
+            new ifstream(ShardName(OutputName, k).c_str(), ios::binary)));
+        if (!*ShardInputs[k])
+        {
+            cout << "Cannot open shard file " << ShardName(OutputName, k) << endl;
+            RemoveShards(OutputName, ExpParams.NumShards);
+            exit(1);
+        }
+    }
+}
+
+void EXPERIMENT::CloseShards()
+{
+    ShardInputs.clear();
+    RemoveShards(OutputName, ExpParams.NumShards);
+}
+
+void EXPERIMENT::ReadShardRun(int sweep, int n, RESULTS& run)
+{
+    ifstream& input = *ShardInputs[n % ExpParams.NumShards];
+    int key[2];
+    input.read((char*) key, sizeof(key));
+    run.Read(input);
+    if (!input || key[0] != sweep || key[1] != n)
+    {
+        cout << "Shard file " << ShardName(OutputName, n % ExpParams.NumShards)
+            << " has no results for run " << n + 1 << endl;
+        ShardInputs.clear();
+        RemoveShards(OutputName, ExpParams.NumShards);
+        exit(1);
+    }
+}
+
+void EXPERIMENT::WriteShardRun(int sweep, int n, const RESULTS& run)
+{
+    int key[2] = { sweep, n };
+    ShardOutput.write((const char*) key, sizeof(key));
+    run.Write(ShardOutput);
+}
+
+void EXPERIMENT::SaveCheckpoint(int sweep, int runs, const RESULTS& results)
+{
+    // Written aside and then renamed, so a crash keeps the last checkpoint
+    string name = CheckpointName();
+    ofstream checkpoint((name + ".tmp").c_str(), ios::binary);
+    int header[6] = { ExpParams.Seed, ExpParams.NumRuns,
+        ExpParams.MinDoubles, ExpParams.MaxDoubles, sweep, runs };
+    // Flushed first, so that the size recorded is on disk
+    OutputFile.flush();
+    long long outputSize = OutputFile.tellp();
+    checkpoint.write((const char*) header, sizeof(header));
+    checkpoint.write((const char*) &outputSize, sizeof(outputSize));
+    results.Write(checkpoint);
+    checkpoint.close();
+    if (checkpoint)
+        rename((name + ".tmp").c_str(), name.c_str());
+    else
+        cout << "Cannot write checkpoint " << name << endl;
+    LastCheckpoint = chrono::steady_clock::now();
+}
+
+bool EXPERIMENT::LoadCheckpoint()
+{
+    ifstream checkpoint(CheckpointName().c_str(), ios::binary);
+    if (!checkpoint)
+    {
+        cout << "No checkpoint to resume, starting from the first run" << endl;
+        return false;
+    }
+    int header[6];
+    long long outputSize;
+    checkpoint.read((char*) header, sizeof(header));
+    checkpoint.read((char*) &outputSize, sizeof(outputSize));
+    ResumeResults = Results;
+    ResumeResults.Read(checkpoint);
+    if (!checkpoint || header[0] != ExpParams.Seed || header[1] != ExpParams.NumRuns
+        || header[2] != ExpParams.MinDoubles || header[3] != ExpParams.MaxDoubles)
+    {
+        cout << "Checkpoint " << CheckpointName() << " is not for this experiment" << endl;
+        exit(1);
+    }
+
+    // Drop any results written after the checkpoint, as they will be again.
+    // A file shorter than the checkpoint has lost results it recorded.
+    struct stat output;
+    if (stat(OutputName.c_str(), &output) != 0 || output.st_size < outputSize)
+    {
+        cout << "Results file " << OutputName << " is shorter than its checkpoint" << endl;
+        exit(1);
+    }
+    if (truncate(OutputName.c_str(), outputSize) != 0)
+    {
+        cout << "Cannot resume results file " << OutputName << endl;
+        exit(1);
+    }
+    ResumeSweep = header[4];
+    ResumeRuns = header[5];
+    cout << "Resuming sweep " << ResumeSweep + 1 << " at run " << ResumeRuns + 1 << endl;
+    return true;
+}
+
+bool EXPERIMENT::LaunchShards(int argc, char* argv[], int numShards, const string& outputFile)
+{
+    vector<pid_t> shards;
+    for (int k = 0; k < numShards; k++)
+    {
+        string shard = to_string(k);
+        vector<char*> args(argv, argv + argc);
+        args.push_back((char*) "--shard");
+        args.push_back(&shard[0]);
+        args.push_back(0);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            execvp(argv[0], &args[0]);
+            _exit(127);
+        }
+        if (pid < 0)
+        {
+            cout << "Cannot start shard " << k << endl;
+            break;
+        }
+        shards.push_back(pid);
+    }
+
+    bool success = (int) shards.size() == numShards;
+    for (int k = 0; k < (int) shards.size(); k++)
+    {
+        int status;
+        waitpid(shards[k], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            cout << "Shard " << k << " failed" << endl;
+            success = false;
+        }
+    }
+    if (!success)
+        RemoveShards(outputFile, numShards);
+    return success;
+}
+
+//----------------------------------------------------------------------------
+
+STEP_LOG::STEP_LOG(const string& fileName)
+:   File(fileName.c_str(), ios::app),
+    Done(false)
+{
+    Writer = thread(&STEP_LOG::Write, this);
+}
+
+STEP_LOG::~STEP_LOG()
+{
+    {
+        lock_guard<mutex> lock(Mutex);
+        Done = true;
+    }
+    Ready.notify_one();
+    Writer.join();
+}
+
+void STEP_LOG::Add(const STEP_RECORD& record)
+{
+    {
+        lock_guard<mutex> lock(Mutex);
+        Queue.push_back(record);
+    }
+    Ready.notify_one();
+}
+
+void STEP_LOG::Write()
+{
+    File.precision(6);
+    vector<STEP_RECORD> batch;
+    for (;;)
+    {
+        {
+            unique_lock<mutex> lock(Mutex);
+            while (Queue.empty() && !Done)
+                Ready.wait(lock);
+            if (Queue.empty())
+                return;
+            batch.swap(Queue);
+        }
+
+        for (int i = 0; i < (int) batch.size(); i++)
+        {
+            const STEP_RECORD& record = batch[i];
+            File << "{\"sweep\":" << record.Sweep
+                << ",\"run\":" << record.Run
+                << ",\"step\":" << record.Step
+                << ",\"agent\":" << record.Agent
+                << ",\"action\":" << record.Action
+                << ",\"observation\":" << record.Observation
+                << ",\"reward\":" << record.Reward
+                << ",\"simulations\":" << record.Simulations
+                << ",\"nodes\":" << record.TreeNodes
+                << ",\"particles\":" << record.Particles
+                << ",\"latency\":" << record.Latency << "}\n";
+        }
+        File.flush();
+        batch.clear();
+    }
+}
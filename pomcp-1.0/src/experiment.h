@@ -5,12 +5,17 @@
 #include "simulator.h"
 #include "statistic.h"
 #include <fstream>
+#include <memory>
+#include <condition_variable>
 
 //----------------------------------------------------------------------------
 
 struct RESULTS
 {
     void Clear();
+    void Merge(const RESULTS& results);
+    void Write(std::ostream& ostr) const;
+    void Read(std::istream& istr);
 
     STATISTIC Time;
     STATISTIC Reward;
@@ -20,6 +25,9 @@ struct RESULTS
     std::vector<STATISTIC> PlanSequenceReward;
     std::vector<STATISTIC> PlanSequenceLength;
     STATISTIC JointGoalCount;
+    STATISTIC Simulations;
+    std::vector<HISTOGRAM> SelectLatency; // per agent, in seconds
+    std::vector<HISTOGRAM> UpdateLatency;
 };
 
 inline void RESULTS::Clear()
@@ -29,14 +37,106 @@ inline void RESULTS::Clear()
     DiscountedReturn.Clear();
     UndiscountedReturn.Clear();
     JointGoalCount.Clear();
+    Simulations.Clear();
     for (int i = 0; i < (int) SuccessfulPlanCount.size(); i++)
     {
 	SuccessfulPlanCount[i].Clear();
 	PlanSequenceReward[i].Clear();
 	PlanSequenceLength[i].Clear();
+	SelectLatency[i].Clear();
+	UpdateLatency[i].Clear();
     }
 }
 
+inline void RESULTS::Merge(const RESULTS& results)
+{
+    Time.Merge(results.Time);
+    Reward.Merge(results.Reward);
+    DiscountedReturn.Merge(results.DiscountedReturn);
+    UndiscountedReturn.Merge(results.UndiscountedReturn);
+    JointGoalCount.Merge(results.JointGoalCount);
+    Simulations.Merge(results.Simulations);
+    for (int i = 0; i < (int) SuccessfulPlanCount.size(); i++)
+    {
+	SuccessfulPlanCount[i].Merge(results.SuccessfulPlanCount[i]);
+	PlanSequenceReward[i].Merge(results.PlanSequenceReward[i]);
+	PlanSequenceLength[i].Merge(results.PlanSequenceLength[i]);
+	SelectLatency[i].Merge(results.SelectLatency[i]);
+	UpdateLatency[i].Merge(results.UpdateLatency[i]);
+    }
+}
+
+inline void RESULTS::Write(std::ostream& ostr) const
+{
+    Time.Write(ostr);
+    Reward.Write(ostr);
+    DiscountedReturn.Write(ostr);
+    UndiscountedReturn.Write(ostr);
+    JointGoalCount.Write(ostr);
+    Simulations.Write(ostr);
+    for (int i = 0; i < (int) SuccessfulPlanCount.size(); i++)
+    {
+	SuccessfulPlanCount[i].Write(ostr);
+	PlanSequenceReward[i].Write(ostr);
+	PlanSequenceLength[i].Write(ostr);
+	SelectLatency[i].Write(ostr);
+	UpdateLatency[i].Write(ostr);
+    }
+}
+
+inline void RESULTS::Read(std::istream& istr)
+{
+    Time.Read(istr);
+    Reward.Read(istr);
+    DiscountedReturn.Read(istr);
+    UndiscountedReturn.Read(istr);
+    JointGoalCount.Read(istr);
+    Simulations.Read(istr);
+    for (int i = 0; i < (int) SuccessfulPlanCount.size(); i++)
+    {
+	SuccessfulPlanCount[i].Read(istr);
+	PlanSequenceReward[i].Read(istr);
+	PlanSequenceLength[i].Read(istr);
+	SelectLatency[i].Read(istr);
+	UpdateLatency[i].Read(istr);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Append-only log of every search decision, one JSON object per line.
+// Records are queued and written by a background thread, which flushes
+// after each batch so that the log survives a crash up to the last batch.
+
+struct STEP_RECORD
+{
+    int Sweep, Run, Step, Agent;
+    int Action, Observation;
+    double Reward;
+    int Simulations, TreeNodes, Particles;
+    double Latency;
+};
+
+class STEP_LOG
+{
+public:
+
+    STEP_LOG(const std::string& fileName);
+    ~STEP_LOG();
+
+    void Add(const STEP_RECORD& record);
+
+private:
+
+    void Write();
+
+    std::ofstream File;
+    std::vector<STEP_RECORD> Queue;
+    bool Done;
+    std::mutex Mutex;
+    std::condition_variable Ready;
+    std::thread Writer;
+};
+
 //----------------------------------------------------------------------------
 
 class EXPERIMENT
@@ -61,27 +161,88 @@ public:
         bool AutoExploration;
 	bool BreakOnTerminate;
 	std::vector<bool> RandomActions;
+	int Seed; // run n uses stream n of this seed
+	int NumRunThreads; // runs played at once, each with its own search
+	int NumShards; // processes sharing the runs
+	int Shard; // runs n with n % NumShards == Shard, or -1 to merge all shards
+	double CheckpointInterval; // seconds between checkpoints, 0 for none
+	bool Resume; // continue from the last checkpoint
+	std::string StepLog; // file for the per-step log, empty for none
     };
 
     EXPERIMENT(const SIMULATOR& real, const SIMULATOR& simulator, 
         const std::string& outputFile, 
         EXPERIMENT::PARAMS& expParams, MCTS::PARAMS& searchParams);
 
-    void Run();
+    // Plays one episode, adding its statistics to results. The sweep and
+    // run number only label the per-step log.
+    void Run(RESULTS& results, int sweep = 0, int n = 0);
     void MultiRun();
     void DiscountedReturn();
     void AverageReward();
 
+    // Starts each shard as a copy of this command with --shard added, and
+    // waits for them all to succeed. Removes the shard files if any fails.
+    static bool LaunchShards(int argc, char* argv[], int numShards, const std::string& outputFile);
+
 private:
 
+    // Adds a finished run to Results, in run order, and reports it.
+    // Returns false once the runs so far have used up TimeOut.
+    bool AddRun(const RESULTS& run, int n);
+    void WriteHeader();
+    void WriteResults();
+
+    // Searches and updates for one agent, timing each one
+    int SelectAction(MCTS& mcts, int index, RESULTS& results, double& latency) const;
+    bool Update(MCTS& mcts, int action, int observation, double reward,
+        int index, RESULTS& results) const;
+    int GetNumSearchAgents() const { return SearchParams.MultiAgent ? Real.GetNumAgents() : 1; }
+    // Runs may be played at once, so each message is written whole, under
+    // ReportMutex, and names the run it came from
+    void ReportRun(int n, const std::string& message) const;
+    // Fills in the agent's part of record and queues it
+    void LogStep(const MCTS& mcts, STEP_RECORD record, int index,
+        int action, int observation, double latency) const;
+
+    // A shard writes each of its runs to its own file, in run order, and
+    // the merging process reads them back in place of playing them
+    bool IsShard() const { return ExpParams.NumShards > 1 && ExpParams.Shard >= 0; }
+    bool MergesShards() const { return ExpParams.NumShards > 1 && ExpParams.Shard < 0; }
+    static std::string ShardName(const std::string& outputFile, int shard);
+    static void RemoveShards(const std::string& outputFile, int numShards);
+    void OpenShardOutput();
+    void OpenShards();
+    void CloseShards();
+    void ReadShardRun(int sweep, int n, RESULTS& run);
+    void WriteShardRun(int sweep, int n, const RESULTS& run);
+
+    // A checkpoint holds Results part way through a sweep, and how much of
+    // the results file is complete. Run n always uses stream n of the seed,
+    // so the run index is all that is needed to continue the random numbers.
+    bool Checkpoints() const { return ExpParams.CheckpointInterval > 0 && ExpParams.NumShards <= 1; }
+    std::string CheckpointName() const { return OutputName + ".checkpoint"; }
+    void SaveCheckpoint(int sweep, int runs, const RESULTS& results);
+    bool LoadCheckpoint();
+
     const SIMULATOR& Real;
     const SIMULATOR& Simulator;
     EXPERIMENT::PARAMS& ExpParams;
     MCTS::PARAMS& SearchParams;
     RESULTS Results;
 
+    std::string OutputName;
     std::ofstream OutputFile;
     bool UpdatePlanStatistics;
+    int NumSweeps; // calls to MultiRun so far
+    std::ofstream ShardOutput;
+    std::vector<std::unique_ptr<std::ifstream> > ShardInputs;
+    std::chrono::steady_clock::time_point LastCheckpoint;
+    bool Resumed;
+    int ResumeSweep, ResumeRuns;
+    RESULTS ResumeResults;
+    std::unique_ptr<STEP_LOG> StepLog;
+    mutable std::mutex ReportMutex;
 };
 
 //----------------------------------------------------------------------------
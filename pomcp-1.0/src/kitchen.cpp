@@ -2,8 +2,6 @@
 #include <iomanip>
 #include <tr1/unordered_set>
 
-boost::math::beta_distribution<> betak(0.9,0.9);
-
 KITCHEN::KITCHEN(bool testTrayOnStove, bool testCerealInCupboard): 
   NumPlates(0), NumCups(0), NumLocations(5),
   LOCATION_OFFSET(static_cast<int>(CUPBOARD)), 
@@ -124,8 +122,8 @@ KITCHEN::KITCHEN(bool testTrayOnStove, bool testCerealInCupboard):
     MaxReward = 100.0;
     Discount = 1.0;
     
-    for (int i = 0; i < 100; i++)
-	quantiles.push_back(boost::math::quantile(betak, UTILS::RandomDouble(0.0, 1.0)));
+    quantiles.resize(100);
+    UTILS::Beta(quantiles, 0.9, 0.9);
 }
 
 STATE* KITCHEN::Copy(const STATE& state) const
@@ -139,9 +137,11 @@ STATE* KITCHEN::Copy(const STATE& state) const
 void KITCHEN::Validate(const STATE& state) const
 {
     const KITCHEN_STATE& kitchenstate = safe_cast<const KITCHEN_STATE&>(state);
-    assert(IsLocation(kitchenstate.RobotLocation));
+    for (int i = 0; i < NumAgents; i++)
+	assert(IsLocation(kitchenstate.RobotLocations[i]));
+    // Objects held in a gripper have no location
     for (int i = 0; i<NumObjects; i++)
-	assert(IsLocation(kitchenstate.ObjectLocations[i]));
+	assert(IsLocation(kitchenstate.ObjectLocations[i]) || kitchenstate.InWhichGripper[i].first != -1);
 }
 
 void KITCHEN::FreeState(STATE* state) const
@@ -150,6 +150,12 @@ void KITCHEN::FreeState(STATE* state) const
     MemoryPool.Free(kitchenstate);
 }
 
+void KITCHEN::TrimMemory() const
+{
+    MemoryPool.Trim();
+    SIMULATOR::TrimMemory();
+}
+
 STATE* KITCHEN::CreateStartState() const
 {
     KITCHEN_STATE* kitchenstate = MemoryPool.Allocate();
@@ -265,7 +271,7 @@ bool KITCHEN::Step(STATE& state, int action, int& observation, double& reward, S
 	    agentactions.push_back(std::make_pair(i,action/((int) pow(NumAgentActions, i))));
 	    action = action%((int) pow(NumAgentActions, i)); 
 	}
-	std::random_shuffle(agentactions.begin(), agentactions.end());
+	UTILS::RandomShuffle(agentactions);
 	
 	//Check for joint actions
 	std::vector< std::pair<int, int> > jointinds;
@@ -826,6 +832,9 @@ bool KITCHEN::StepAgent(KITCHEN_STATE& kitchenstate, int action,
 	default:
 	    break;
     }
+    
+    // Only Step decides whether the episode is over
+    return false;
 }
 
 bool KITCHEN::LocalMove(STATE& state, const HISTORY& history, int stepObs, const SIMULATOR::STATUS& status) const
@@ -933,7 +942,8 @@ int KITCHEN::MakeObservation(const KITCHEN_STATE& state, const int& index) const
 		    ko.RightGripperContents[state.InWhichGripper[i].first] = i;
 	    }
 	}
-	else if (state.RobotLocations[state.InWhichGripper[i].first] == state.RobotLocations[index])
+	else if (state.InWhichGripper[i].first != -1 &&
+	    state.RobotLocations[state.InWhichGripper[i].first] == state.RobotLocations[index])
 	{
 	    if (UTILS::RandomDouble(0.0,1.0) < ProbObservation*ProbObservation)
 	    {
@@ -965,7 +975,8 @@ int KITCHEN::MakeObservation(const KITCHEN_STATE& state, const int& index) const
 		    ko.RightGripperContents[state.TraySecondGripper.first] = i;
 	    }
 	}
-	else if (state.RobotLocations[state.TraySecondGripper.first] == state.RobotLocations[index])
+	else if (state.TraySecondGripper.first != -1 &&
+	    state.RobotLocations[state.TraySecondGripper.first] == state.RobotLocations[index])
 	{
 	    if (UTILS::RandomDouble(0.0,1.0) < ProbObservation*ProbObservation)
 	    {
@@ -59,12 +59,14 @@ int main(int argc, char* argv[])
     bool rewAdaptive1 = false, rewAdaptive2 = false;
     bool humanDefined1 = false, humanDefined2 = false;
     bool random1 = false, random2 = false;
+    double exploration1 = -1, exploration2 = -1;
     
 
     options_description desc("Allowed options");
     desc.add_options()
         ("help", "produce help message")
         ("test", "run unit tests")
+        ("benchucb", "time UCB action selection with and without SIMD")
         ("problem", value<string>(&problem), "problem to run")
         ("outputfile", value<string>(&outputfile)->default_value("output.txt"), "summary output file")
         ("policy", value<string>(&policy), "policy file (explicit POMDPs only)")
@@ -91,8 +93,21 @@ int main(int argc, char* argv[])
         ("smarttreecount", value<int>(&knowledge.SmartTreeCount), "Prior count for preferred actions during smart tree search")
         ("smarttreevalue", value<double>(&knowledge.SmartTreeValue), "Prior value for preferred actions during smart tree search")
         ("disabletree", value<bool>(&searchParams.DisableTree), "Use 1-ply rollout action selection")
+        ("threads", value<int>(&searchParams.NumThreads), "Number of search threads")
+        ("treeparallel", value<bool>(&searchParams.TreeParallel), "Search threads share one tree (default is root parallel)")
+        ("virtualloss", value<double>(&searchParams.VirtualLoss), "Virtual loss for tree parallel search")
+        ("timelimit", value<double>(&searchParams.TimeLimit), "Search time per action (seconds), 0 for no limit")
+        ("reusetree", value<bool>(&searchParams.ReuseTree), "Keep the matched subtree after each real step")
+        ("backgroundreclaim", value<bool>(&searchParams.BackgroundReclaim), "Free dropped trees in a background thread")
 	("multiagent", value<bool>(&searchParams.MultiAgent), "Distributed decision making")
 	("breakonterminate", value<bool>(&expParams.BreakOnTerminate), "Break the loop when a goal state is reached")
+	("seed", value<int>(&expParams.Seed), "Random seed, each run using its own stream")
+	("runthreads", value<int>(&expParams.NumRunThreads), "Number of runs played at once")
+	("shards", value<int>(&expParams.NumShards), "Number of processes sharing the runs")
+	("shard", value<int>(&expParams.Shard), "Play only this shard's runs (set by --shards)")
+	("checkpoint", value<double>(&expParams.CheckpointInterval), "Seconds between checkpoints, 0 for none")
+	("resume", value<bool>(&expParams.Resume), "Continue from the last checkpoint")
+	("steplog", value<string>(&expParams.StepLog), "Append a JSON line for every search decision to this file")
 	("numsmallboxes", value<int>(&numSmallBoxes), "Number of small boxes (boxpushing problem)")
 	("problargeboxagent", value<double>(&probLargeBoxAgent), "Probability of special observation (boxpushing problem)")
 	("testtray", value<bool>(&testTrayOnStove), "Test tray on stove (kitchen problem)")
@@ -103,6 +118,8 @@ int main(int argc, char* argv[])
 	("humandefined2", value<bool>(&humanDefined2), "Second agent human-defined")
 	("random1", value<bool>(&random1), "First agent random")
 	("random2", value<bool>(&random2), "Second agent random")
+	("exploration1", value<double>(&exploration1), "UCB exploration constant of first agent (default is exploration)")
+	("exploration2", value<double>(&exploration2), "UCB exploration constant of second agent (default is exploration)")
         ;
 
     variables_map vm;
@@ -115,6 +132,8 @@ int main(int argc, char* argv[])
     searchParams.HumanDefined[1] = humanDefined2;
     expParams.RandomActions[0] = random1;
     expParams.RandomActions[1] = random2;
+    searchParams.AgentExploration[0] = exploration1;
+    searchParams.AgentExploration[1] = exploration2;
 
     if (vm.count("help"))
     {
@@ -128,6 +147,19 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if (expParams.Resume && expParams.CheckpointInterval <= 0)
+    {
+        cout << "Cannot resume with --checkpoint 0" << endl;
+        return 1;
+    }
+
+    // Sharded sweeps keep no checkpoints
+    if (expParams.Resume && expParams.NumShards > 1)
+    {
+        cout << "Cannot resume with --shards" << endl;
+        return 1;
+    }
+
     if (vm.count("test"))
     {
         cout << "Running unit tests" << endl;
@@ -135,6 +167,12 @@ int main(int argc, char* argv[])
         return 0;
     }
 
+    if (vm.count("benchucb"))
+    {
+        MCTS::BenchmarkUCB(cout);
+        return 0;
+    }
+
     SIMULATOR* real = 0;
     SIMULATOR* simulator = 0;
     
@@ -196,6 +234,9 @@ int main(int argc, char* argv[])
 
 
     simulator->SetKnowledge(knowledge);
+    if (expParams.NumShards > 1 && expParams.Shard < 0
+        && !EXPERIMENT::LaunchShards(argc, argv, expParams.NumShards, outputfile))
+        return 1;
     EXPERIMENT experiment(*real, *simulator, outputfile, expParams, searchParams);
     experiment.DiscountedReturn();
 
@@ -3,6 +3,11 @@
 #include <math.h>
 
 #include <algorithm>
+#include <thread>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 using namespace UTILS;
@@ -30,7 +35,13 @@ MCTS::PARAMS::PARAMS()
     RewardOffset(100.0),
     InitialRewardWeight(20.0),
     MultiAgentPriorCount(0),
-    MultiAgentPriorValue(0.0)
+    MultiAgentPriorValue(0.0),
+    NumThreads(1),
+    TreeParallel(false),
+    VirtualLoss(1.0),
+    TimeLimit(0),
+    ReuseTree(false),
+    BackgroundReclaim(false)
 {
     JointQActions.clear();
     MinMax.clear();
@@ -48,16 +59,40 @@ MCTS::PARAMS::PARAMS()
     
     HumanDefined.push_back(false);
     HumanDefined.push_back(false);
+    
+    AgentExploration.push_back(-1);
+    AgentExploration.push_back(-1);
 }
 
 MCTS::MCTS(const SIMULATOR& simulator, const PARAMS& params)
 :   Simulator(simulator),
     Params(params),
-    TreeDepth(0)
+    TreeDepth(0),
+    Worker(false),
+    SharedTree(false),
+    StreamSeed(0),
+    Stream(0),
+    Master(0)
 {
-    //VNODE::NumChildren = Params.MultiAgent && !Params.JointQActions[0] ? Simulator.GetNumAgentActions() : 
-	//		Simulator.GetNumActions();
-    QNODE::NumChildren = Params.MultiAgent ? Simulator.GetNumAgentObservations() : Simulator.GetNumObservations();
+    // UCB caches are filled on demand, once the exploration constants are known
+    UCBCaches.resize(Simulator.GetNumAgents());
+    for (int i = 0; i < Simulator.GetNumAgents(); i++)
+    {
+	UCBCaches[i].ExplorationConstant = Params.AgentExploration[i] >= 0 ? 
+	    Params.AgentExploration[i] : Params.ExplorationConstant;
+	UCBCaches[i].Rows = 0;
+    }
+    UCBHits.assign(Simulator.GetNumAgents(), 0);
+    UCBMisses.assign(Simulator.GetNumAgents(), 0);
+    
+    for (int i = 0; i < 2 * Simulator.GetNumAgents(); i++)
+    {
+	Arenas.push_back(new MEMORY_POOL<VNODE>);
+	Arenas.back()->SetTrimOnReset(true);
+	Arenas.back()->SetObjectSize(GetNodeBytes(Params.MultiAgent ? i / 2 + 1 : 0));
+    }
+    CurrentArenas.assign(Simulator.GetNumAgents(), 0);
+    Reclaimers.resize(Simulator.GetNumAgents());
     
     Statuses.clear();
     Roots.clear();
@@ -94,19 +129,10 @@ MCTS::MCTS(const SIMULATOR& simulator, const PARAMS& params)
 	StatRolloutDepths.push_back(StatRolloutDepth);
 	STATISTIC StatTotalReward;
 	StatTotalRewards.push_back(StatTotalReward);
+	SimulationCounts.push_back(0);
 	//root
-	VNODE* root; 
-	root->NumChildren = Params.MultiAgent && !Params.JointQActions[i] ? Simulator.GetNumAgentActions() : 
-			Simulator.GetNumActions();
-	if (Params.RewardAdaptive[i])
-	{
-	    //if (Params.JointQActions[i])
-		QNODE::NumOtherAgentValues = 1;
-	    //else
-		//QNODE::NumOtherAgentValues = Simulator.GetNumAgentActions();
-	}
 	STATE* state = Simulator.CreateStartState();
-	root = ExpandNode(state, Params.MultiAgent ? i+1 : i, Params.MultiAgent ? i+1 : i);
+	VNODE* root = ExpandNode(state, Params.MultiAgent ? i+1 : i, Params.MultiAgent ? i+1 : i);
 	Roots.push_back(root);
 	OriginalRoots.push_back(root);
     }
@@ -117,14 +143,46 @@ MCTS::MCTS(const SIMULATOR& simulator, const PARAMS& params)
 	    Roots[i]->Beliefs().AddSample(Simulator.CreateStartState());
 }
 
+MCTS::MCTS(const MCTS& master, const int& index, VNODE* root, bool sharedTree)
+:   Simulator(master.Simulator),
+    TreeDepth(0),
+    Params(master.Params),
+    Roots(master.Roots),
+    Histories(master.Histories),
+    Statuses(master.Statuses),
+    StatTreeDepths(master.StatTreeDepths),
+    StatRolloutDepths(master.StatRolloutDepths),
+    StatTotalRewards(master.StatTotalRewards),
+    SimulationCounts(master.SimulationCounts),
+    Deadline(master.Deadline),
+    Worker(true),
+    SharedTree(sharedTree),
+    StreamSeed(0),
+    Stream(0),
+    Master(&master)
+{
+    UCBHits.assign(Simulator.GetNumAgents(), 0);
+    UCBMisses.assign(Simulator.GetNumAgents(), 0);
+    Params.NumThreads = 1;
+    Params.Verbose = 0;
+    Roots[index == 0 ? index : index-1] = root;
+}
+
 MCTS::~MCTS()
 {
+    // Worker trees are merged and freed by the master
+    if (Worker)
+        return;
+    // Original roots are either current or already freed by Update,
+    // and deleting the arenas releases all remaining nodes
     for (int i = 0; i < Simulator.GetNumAgents() ; i++)
     {
-	VNODE::Free(Roots[i], Simulator);
-	VNODE::Free(OriginalRoots[i], Simulator);
+	if (Reclaimers[i].joinable())
+	    Reclaimers[i].join();
+	VNODE::FreeBeliefs(Roots[i], Simulator);
     }
-    VNODE::FreeAll();
+    for (int i = 0; i < (int) Arenas.size(); i++)
+	delete Arenas[i];
 }
 
 bool MCTS::Update(int action, int observation, double reward, const int& index)
@@ -152,7 +210,8 @@ bool MCTS::Update(int action, int observation, double reward, const int& index)
     {
         if (Params.Verbose >= 1)
             cout << "Matched " << vnode->Beliefs().GetNumSamples() << " states" << endl;
-        beliefs.Copy(vnode->Beliefs(), Simulator);
+        if (!Params.ReuseTree)
+            beliefs.Copy(vnode->Beliefs(), Simulator);
     }
     else
     {
@@ -160,6 +219,23 @@ bool MCTS::Update(int action, int observation, double reward, const int& index)
             cout << "No matching node found" << endl;
     }
 
+    // Promote the matched node to root, keeping its subtree, statistics and particles
+    if (Params.ReuseTree && vnode)
+    {
+	if (Params.UseTransforms)
+	    AddTransforms(Roots[index == 0 ? index : index-1], vnode->Beliefs(), index);
+	if (vnode->Beliefs().Empty())
+	    return false;
+	if (Params.Verbose >= 1)
+	    Simulator.DisplayBeliefs(vnode->Beliefs(), cout);
+	
+	// Detach it first, so only its siblings are freed
+	qnode.RemoveChild(observation);
+	Reclaim(index, Roots[index == 0 ? index : index-1], &NodePool(index), false);
+	Roots[index == 0 ? index : index-1] = vnode;
+	return true;
+    }
+
     // Generate transformed states to avoid particle deprivation
     if (Params.UseTransforms)
 	AddTransforms(Roots[index == 0 ? index : index-1], beliefs, index);
@@ -178,10 +254,13 @@ bool MCTS::Update(int action, int observation, double reward, const int& index)
     else
         state = beliefs.GetSample(0);
 
-    // Delete old tree and create new root
-    VNODE::Free(Roots[index == 0 ? index : index-1], Simulator);
+    // Create new root in the other arena, then release the old tree
+    MEMORY_POOL<VNODE>* oldArena = &NodePool(index);
+    WaitReclaim(index);
+    CurrentArenas[index == 0 ? index : index-1] ^= 1;
     VNODE* newRoot = ExpandNode(state, index, index);
     newRoot->Beliefs() = beliefs;
+    Reclaim(index, Roots[index == 0 ? index : index-1], oldArena, true);
     if (!Params.MultiAgent)
 	Roots[index] = newRoot;
     else
@@ -214,9 +293,11 @@ void MCTS::RolloutSearch(const int& index)
     std::vector<int> legal;
     assert(BeliefState(index).GetNumSamples() > 0);
     Simulator.GenerateLegal(*BeliefState(index).GetSample(0), GetHistory(index), legal, GetStatus(index));
-    random_shuffle(legal.begin(), legal.end());
+    RandomShuffle(legal);
 
-    for (int i = 0; i < Params.NumSimulations; i++)
+    StartClock();
+    int i;
+    for (i = 0; !SearchDone(i); i++)
     {
 	    int action = legal[i % legal.size()];
 	    STATE* state = Roots[index == 0 ? index : index-1]->Beliefs().CreateSample(Simulator);
@@ -248,12 +329,13 @@ void MCTS::RolloutSearch(const int& index)
 		}*/
 	    }
 
-	    VNODE*& vnode = Roots[index == 0 ? index : index-1]->Child(treeaction).Child(index == 0 ?
-		    observation : Simulator.GetAgentObservation(observation,index));			
+	    QNODE& qnode = Roots[index == 0 ? index : index-1]->Child(treeaction);
+	    int treeobservation = index == 0 ? observation : Simulator.GetAgentObservation(observation,index);
+	    VNODE* vnode = qnode.Child(treeobservation);
 	    
 	    if (!vnode && !terminal)
 	    {
-		    vnode = ExpandNode(state, index, index);
+		    vnode = qnode.AddChild(treeobservation, ExpandNode(state, index, index));
 		    AddSample(vnode, *state);
 	    }
 	    
@@ -262,7 +344,7 @@ void MCTS::RolloutSearch(const int& index)
 	    double otherDelayedReward = 0.0;
 	    delayedReward = Rollout(*state, index, otherDelayedReward);
 	    totalReward = immediateReward + Simulator.GetDiscount() * delayedReward;
-	    Roots[index == 0 ? index : index-1]->Child(treeaction).Value.Add(totalReward);
+	    Roots[index == 0 ? index : index-1]->Child(treeaction).Value().Add(totalReward);
 	    
 	    if (Params.RewardAdaptive[index == 0 ? index : index-1])
 	    {
@@ -278,11 +360,50 @@ void MCTS::RolloutSearch(const int& index)
 	    Simulator.FreeState(state);
 	    Histories[index == 0 ? index : index-1].Truncate(historyDepth);
     }
+    SimulationCounts[index == 0 ? index : index-1] = i;
+}
+
+void MCTS::StartClock()
+{
+    // Workers keep the deadline of the search that started them
+    if (!Worker && Params.TimeLimit > 0)
+	Deadline = std::chrono::steady_clock::now() + 
+	    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(Params.TimeLimit));
+}
+
+bool MCTS::SearchDone(int n) const
+{
+    // With a time limit, zero simulations means search until the deadline
+    if (Params.TimeLimit > 0)
+	return (Params.NumSimulations > 0 && n >= Params.NumSimulations) ||
+	    std::chrono::steady_clock::now() >= Deadline;
+    return n >= Params.NumSimulations;
+}
+
+int MCTS::GetNumWorkers() const
+{
+    // A worker with no share of the budget would search until the deadline
+    if (Params.NumSimulations > 0)
+	return std::min(Params.NumThreads, Params.NumSimulations);
+    return Params.NumThreads;
 }
 
 void MCTS::UCTSearch(const int& index)
 {
+    if (Worker)
+	RandomSeed(StreamSeed, Stream);
+    StartClock();
     ClearStatistics(index);
+    if (Params.NumThreads > 1)
+    {
+        if (Params.TreeParallel)
+            TreeParallelSearch(index);
+        else
+            RootParallelSearch(index);
+        return;
+    }
+
     int historyDepth = GetHistory(index).Size();
     
     Statuses[index == 0 ? index : index-1].SuccessfulPlanCount = 0;
@@ -291,7 +412,7 @@ void MCTS::UCTSearch(const int& index)
 
     int n = 0;
     
-    while (n < Params.NumSimulations)
+    while (!SearchDone(n))
     {
         STATE* state = Roots[index == 0 ? index : index-1]->Beliefs().CreateSample(Simulator);
 	//REWARD_TEMPLATE* rewardTemplate;
@@ -299,7 +420,7 @@ void MCTS::UCTSearch(const int& index)
 	if (Params.MultiAgent && Params.RewardAdaptive[index == 0 ? index : index-1])
 	{
 	    //rewardTemplate = Roots[index == 0 ? index : index-1]->Beliefs().CreateRewardSample(Simulator);
-	    rewardTemplateValue = Roots[index == 0 ? index : index-1]->Beliefs().GetRewardSample(0)->RewardValue;
+	    rewardTemplateValue = Roots[index == 0 ? index : index-1]->Beliefs().GetRewardValue(0);
 	    Statuses[index == 0 ? index : index-1].SampledRewardValue = rewardTemplateValue;
 	}
         Simulator.Validate(*state);
@@ -359,7 +480,7 @@ void MCTS::UCTSearch(const int& index)
 	    bool doLearn = true;
 	    //for (int i = 0; i < Params.NumLearnSimulations; i++)
 	    
-	    while (n < Params.NumSimulations && doLearn) 
+	    while (!SearchDone(n) && doLearn) 
 	    {
 		//STATE* tempState = Simulator.Copy(*initState);
 		STATE* tempState = Roots[index == 0 ? index : index-1]->Beliefs().CreateSample(Simulator);
@@ -427,7 +548,7 @@ void MCTS::UCTSearch(const int& index)
 			VNODE* vnode = Roots[index == 0 ? index : index-1];
 			int indV = (int) Statuses[index == 0 ? index : index-1].MainVValueSequence.size() - 1;
 			int indQ = 0;
-			Roots[index == 0 ? index : index-1]->Value.Subtract(Statuses[index == 0 ? index : 
+			SubtractValue(Roots[index == 0 ? index : index-1]->Value, Statuses[index == 0 ? index : 
 				index-1].MainVValueSequence[indV]);
 			indV--;
 			int size = (int) Statuses[index == 0 ? index : index-1].MainSequence.size();
@@ -436,8 +557,8 @@ void MCTS::UCTSearch(const int& index)
 			    QNODE& qnode = vnode->Child(Statuses[index == 0 ? index : index-1].MainSequence[j]);
 			    if (indQ < (int) Statuses[index == 0 ? index : index-1].MainQValueSequence.size())
 			    {
-				qnode.Value.Subtract(Statuses[index == 0 ? index : index-1].MainQValueSequence[indQ]);
-				qnode.OtherAgentValues[0].Subtract(Statuses[index == 0 ? index : 
+				SubtractValue(qnode.Value(), Statuses[index == 0 ? index : index-1].MainQValueSequence[indQ]);
+				SubtractValue(qnode.OtherAgentValues[0], Statuses[index == 0 ? index : 
 				    index-1].MainOtherQValueSequence[indQ]);
 				indQ++;
 			    }
@@ -446,7 +567,7 @@ void MCTS::UCTSearch(const int& index)
 				vnode = qnode.Child(Statuses[index == 0 ? index : index-1].MainSequence[j+1]);
 				if (vnode && indV >= 0)
 				{
-				    vnode->Value.Subtract(Statuses[index == 0 ? index : index-1].MainVValueSequence[indV]);
+				    SubtractValue(vnode->Value, Statuses[index == 0 ? index : index-1].MainVValueSequence[indV]);
 				    indV--;
 				}
 			    }
@@ -468,7 +589,7 @@ void MCTS::UCTSearch(const int& index)
 			QNODE& qnode = vnode->Child(Statuses[index == 0 ? index : index-1].LearnSequence[j]);
 			if (indQ < (int) Statuses[index == 0 ? index : index-1].LearnQValueSequence.size())
 			{
-			    qnode.Value.Add(Statuses[index == 0 ? index : index-1].LearnQValueSequence[indQ]);
+			    qnode.Value().Add(Statuses[index == 0 ? index : index-1].LearnQValueSequence[indQ]);
 			    qnode.OtherAgentValues[0].Add(Statuses[index == 0 ? index : 
 				index-1].LearnOtherQValueSequence[indQ]);
 			    indQ++;
@@ -508,7 +629,7 @@ void MCTS::UCTSearch(const int& index)
 			VNODE* vnode = Roots[index == 0 ? index : index-1];
 			int indV = (int) Statuses[index == 0 ? index : index-1].LearnVValueSequence.size() - 1;
 			int indQ = 0;
-			Roots[index == 0 ? index : index-1]->Value.Subtract(Statuses[index == 0 ? index : 
+			SubtractValue(Roots[index == 0 ? index : index-1]->Value, Statuses[index == 0 ? index : 
 				index-1].LearnVValueSequence[indV]);
 			indV--;
 			int size = (int) Statuses[index == 0 ? index : index-1].LearnSequence.size();
@@ -517,8 +638,8 @@ void MCTS::UCTSearch(const int& index)
 			    QNODE& qnode = vnode->Child(Statuses[index == 0 ? index : index-1].LearnSequence[j]);
 			    if (indQ < (int) Statuses[index == 0 ? index : index-1].LearnQValueSequence.size())
 			    {
-				qnode.Value.Subtract(Statuses[index == 0 ? index : index-1].LearnQValueSequence[indQ]);
-				qnode.OtherAgentValues[0].Subtract(Statuses[index == 0 ? index : 
+				SubtractValue(qnode.Value(), Statuses[index == 0 ? index : index-1].LearnQValueSequence[indQ]);
+				SubtractValue(qnode.OtherAgentValues[0], Statuses[index == 0 ? index : 
 				    index-1].LearnOtherQValueSequence[indQ]);
 				indQ++;
 			    }
@@ -527,7 +648,7 @@ void MCTS::UCTSearch(const int& index)
 				vnode = qnode.Child(Statuses[index == 0 ? index : index-1].LearnSequence[j+1]);
 				if (vnode && indV >= 0)
 				{
-				    vnode->Value.Subtract(Statuses[index == 0 ? index : index-1].LearnVValueSequence[indV]);
+				    SubtractValue(vnode->Value, Statuses[index == 0 ? index : index-1].LearnVValueSequence[indV]);
 				    indV--;
 				}
 			    }
@@ -542,12 +663,164 @@ void MCTS::UCTSearch(const int& index)
 	}
 	Statuses[index == 0 ? index : index-1].LearningPhase = false;
     }
-    
-    
+    SimulationCounts[index == 0 ? index : index-1] = n;
+
+    DisplayStatistics(cout, index);
+}
+
+void MCTS::PrepareWorkers(const int& index)
+{
+    // Workers cannot grow the shared UCB cache, so it is first grown to
+    // the largest parent count this search can reach
+    if (Params.DoFastUCB)
+	GrowUCB(index, Params.NumSimulations > 0 ?
+	    Roots[index == 0 ? index : index-1]->Value.GetCount() + Params.NumSimulations : UCB_N);
+}
+
+void MCTS::RootParallelSearch(const int& index)
+{
+    // Each worker searches its own tree, built from a copy of the root beliefs
+    // and starting from the root statistics. The statistics gathered by all
+    // workers are then summed into the root, and the first level of their
+    // trees merged, so that GreedyUCB and Update work as for a single search.
+    VNODE* root = Roots[index == 0 ? index : index-1];
+    VNODE* base = CreateNode(index);
+    base->CopyValues(*root);
+
+    PrepareWorkers(index);
+    int numWorkers = GetNumWorkers();
+    std::vector<MCTS*> workers;
+    std::vector<std::thread> threads;
+    uint64_t seed = RandomBits();
+    for (int t = 0; t < numWorkers; t++)
+    {
+        VNODE* workerRoot = CreateNode(index);
+        workerRoot->CopyValues(*root);
+        workerRoot->Beliefs().Copy(root->Beliefs(), Simulator);
+        MCTS* worker = new MCTS(*this, index, workerRoot, false);
+        worker->StreamSeed = seed;
+        worker->Stream = t;
+        worker->Params.NumSimulations = Params.NumSimulations / numWorkers
+            + (t < Params.NumSimulations % numWorkers ? 1 : 0);
+        workers.push_back(worker);
+    }
+    for (int t = 0; t < numWorkers; t++)
+        threads.push_back(std::thread(&MCTS::UCTSearch, workers[t], index));
+    for (int t = 0; t < numWorkers; t++)
+        threads[t].join();
+
+    SIMULATOR::STATUS& status = Statuses[index == 0 ? index : index-1];
+    status.SuccessfulPlanCount = 0;
+    status.PlanSequenceReward = 0.0;
+    status.PlanSequenceLength = 0;
+    SimulationCounts[index == 0 ? index : index-1] = 0;
+    double rewardValue = 0.0;
+    for (int t = 0; t < numWorkers; t++)
+    {
+        MCTS* worker = workers[t];
+        VNODE* workerRoot = worker->Roots[index == 0 ? index : index-1];
+        const SIMULATOR::STATUS& workerStatus = worker->GetStatus(index);
+        status.SuccessfulPlanCount += workerStatus.SuccessfulPlanCount;
+        status.PlanSequenceReward += workerStatus.PlanSequenceReward;
+        status.PlanSequenceLength += workerStatus.PlanSequenceLength;
+        SimulationCounts[index == 0 ? index : index-1] += worker->GetSimulationCount(index);
+        UCBHits[index == 0 ? index : index-1] += worker->UCBHits[index == 0 ? index : index-1];
+        UCBMisses[index == 0 ? index : index-1] += worker->UCBMisses[index == 0 ? index : index-1];
+        MergeStatistics(*worker, index);
+        if (!workerRoot->Beliefs().EmptyRewards())
+            rewardValue += workerRoot->Beliefs().GetRewardSample(0)->RewardValue;
+        MergeWorkerRoot(root, workerRoot, base);
+        FreeNode(workerRoot, index);
+        delete worker;
+    }
+    FreeNode(base, index);
+
+    // Reward adaptive search learns a reward value in each worker
+    if (Params.MultiAgent && Params.RewardAdaptive[index == 0 ? index : index-1])
+    {
+        rewardValue /= numWorkers;
+        root->Beliefs().SetRewardSample(rewardValue, 0);
+        status.SampledRewardValue = rewardValue;
+    }
 
     DisplayStatistics(cout, index);
 }
 
+void MCTS::TreeParallelSearch(const int& index)
+{
+    // All workers search the same tree, with lock-free value updates and
+    // a virtual loss on the path each thread is currently simulating
+    VNODE* root = Roots[index == 0 ? index : index-1];
+    PrepareWorkers(index);
+    int numWorkers = GetNumWorkers();
+    std::vector<MCTS*> workers;
+    std::vector<std::thread> threads;
+    uint64_t seed = RandomBits();
+    for (int t = 0; t < numWorkers; t++)
+    {
+        MCTS* worker = new MCTS(*this, index, root, true);
+        worker->StreamSeed = seed;
+        worker->Stream = t;
+        worker->Params.NumSimulations = Params.NumSimulations / numWorkers
+            + (t < Params.NumSimulations % numWorkers ? 1 : 0);
+        workers.push_back(worker);
+    }
+    for (int t = 0; t < numWorkers; t++)
+        threads.push_back(std::thread(&MCTS::UCTSearch, workers[t], index));
+    for (int t = 0; t < numWorkers; t++)
+        threads[t].join();
+
+    SIMULATOR::STATUS& status = Statuses[index == 0 ? index : index-1];
+    status.SuccessfulPlanCount = 0;
+    status.PlanSequenceReward = 0.0;
+    status.PlanSequenceLength = 0;
+    SimulationCounts[index == 0 ? index : index-1] = 0;
+    for (int t = 0; t < numWorkers; t++)
+    {
+        const SIMULATOR::STATUS& workerStatus = workers[t]->GetStatus(index);
+        status.SuccessfulPlanCount += workerStatus.SuccessfulPlanCount;
+        status.PlanSequenceReward += workerStatus.PlanSequenceReward;
+        status.PlanSequenceLength += workerStatus.PlanSequenceLength;
+        SimulationCounts[index == 0 ? index : index-1] += workers[t]->GetSimulationCount(index);
+        UCBHits[index == 0 ? index : index-1] += workers[t]->UCBHits[index == 0 ? index : index-1];
+        UCBMisses[index == 0 ? index : index-1] += workers[t]->UCBMisses[index == 0 ? index : index-1];
+        MergeStatistics(*workers[t], index);
+        delete workers[t];
+    }
+    if (Params.MultiAgent && Params.RewardAdaptive[index == 0 ? index : index-1])
+        status.SampledRewardValue = root->Beliefs().GetRewardValue(0);
+
+    DisplayStatistics(cout, index);
+}
+
+void MCTS::MergeWorkerRoot(VNODE* root, VNODE* workerRoot, const VNODE* base)
+{
+    root->MergeValues(*workerRoot, *base);
+    for (int action = 0; action < root->GetNumChildren(); action++)
+    {
+        QNODE& workerq = workerRoot->Child(action);
+        VNODE* child = workerq.FirstChild();
+        while (child)
+        {
+            VNODE* next = workerq.NextChild(child);
+            int observation = child->GetObservation();
+            VNODE* merged = root->Child(action).Child(observation);
+            if (!merged)
+            {
+                // Adopt the first subtree found, so Update can match it
+                workerq.RemoveChild(observation);
+                root->Child(action).AddChild(observation, child);
+            }
+            else
+            {
+                merged->Beliefs().MoveSamples(child->Beliefs());
+                merged->Value.Merge(child->Value);
+            }
+            child = next;
+        }
+    }
+}
+
 double MCTS::SimulateV(STATE& state, VNODE* vnode, const int& index, double otherTotalReward)
 {
     int action = GreedyUCB(vnode, Params.DoFastUCB, index);
@@ -583,12 +856,19 @@ double MCTS::SimulateV(STATE& state, VNODE* vnode, const int& index, double othe
 	Statuses[index == 0 ? index : index-1].MainFullSequence.push_back(action);
     }
     
+    // Discourage other threads from following this path until it is backed up
+    if (SharedTree)
+	qnode.Value().AtomicAdd(-Params.VirtualLoss);
     totalReward = SimulateQ(state, qnode, action, index, otherTotalReward);
+    if (SharedTree)
+	qnode.Value().AtomicSubtract(-Params.VirtualLoss);
     
     if (Statuses[index == 0 ? index : index-1].UpdateValues)
     {
-	vnode->Value.Add(totalReward);
-	AddRave(vnode, totalReward, state, index);
+	AddValue(vnode->Value, totalReward);
+	// AMAF values are only read by GreedyUCB when using RAVE
+	if (Params.UseRave)
+	    AddRave(vnode, totalReward, state, index);
 	
 	if (Statuses[index == 0 ? index : index-1].LearningPhase)
 	    Statuses[index == 0 ? index : index-1].LearnVValueSequence.push_back(totalReward);
@@ -646,12 +926,20 @@ double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action, const int& index,
         Simulator.DisplayState(state, cout);
     }
     
-    VNODE*& vnode = index == 0 ? qnode.Child(observation) : 
-		qnode.Child(Simulator.GetAgentObservation(observation, index));
-	
+    int treeobservation = index == 0 ? observation : Simulator.GetAgentObservation(observation, index);
+    VNODE* vnode = qnode.Child(treeobservation);
+    
+    // Our own virtual loss is not a real visit
+    int count = SharedTree ? qnode.Value().GetCount() - 1 : qnode.Value().GetCount();
 		
-    if (!vnode && !terminal && qnode.Value.GetCount() >= Params.ExpandCount)
-	  vnode = ExpandNode(&state, index, index);
+    if (!vnode && !terminal && count >= Params.ExpandCount)
+    {
+	VNODE* expanded = ExpandNode(&state, index, index);
+	vnode = qnode.AddChild(treeobservation, expanded, SharedTree);
+	// Another thread may have expanded the same child meanwhile
+	if (vnode != expanded)
+	    FreeNode(expanded, index);
+    }
     
     //if (!terminal)
     {
@@ -682,11 +970,11 @@ double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action, const int& index,
 		Statuses[index == 0 ? index : index-1].LearnRewardValueSequence.push_back(rewardTemplate->RewardValue);
 	}
 	Statuses[index == 0 ? index : index-1].SampledRewardValue = rewardTemplate->RewardValue;*/
-	Statuses[index == 0 ? index : index-1].SampledRewardValue = vnode->Beliefs().GetRewardSample(0)->RewardValue;
+	Statuses[index == 0 ? index : index-1].SampledRewardValue = vnode->Beliefs().GetRewardValue(0);
 	
 	if (Statuses[index == 0 ? index : index-1].LearningPhase)
 	    Statuses[index == 0 ? index : index-1].LearnRewardValueSequence.push_back(
-		vnode->Beliefs().GetRewardSample(0)->RewardValue);
+		vnode->Beliefs().GetRewardValue(0));
     }
     else
 	Statuses[index == 0 ? index : index-1].SampledRewardValue = 0.0;
@@ -704,7 +992,7 @@ double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action, const int& index,
     double totalReward = immediateReward + Simulator.GetDiscount() * delayedReward;
     if (Statuses[index == 0 ? index : index-1].UpdateValues)
     {
-	qnode.Value.Add(totalReward);
+	AddValue(qnode.Value(), totalReward);
 	if (Statuses[index == 0 ? index : index-1].LearningPhase)
 	    Statuses[index == 0 ? index : index-1].LearnQValueSequence.push_back(totalReward);
 	else
@@ -717,7 +1005,7 @@ double MCTS::SimulateQ(STATE& state, QNODE& qnode, int action, const int& index,
 		otherTotalReward = otherImmediateReward + Simulator.GetDiscount() * delayedReward;
 	    
 	    //if (Params.JointQActions[index == 0 ? index : index-1])
-		qnode.OtherAgentValues[0].Add(otherTotalReward);
+		AddValue(qnode.OtherAgentValues[0], otherTotalReward);
 	    //else
 	    //{
 		//int otheraction = index == 1 ? Simulator.GetAgentAction(action, 2) : Simulator.GetAgentAction(action, 1);
@@ -751,15 +1039,96 @@ void MCTS::AddRave(VNODE* vnode, double totalReward, const STATE& state, const i
 		action = Simulator.SelectRandom(state, GetHistory(index), GetStatus(index),1) + 
 		    Simulator.GetNumAgentActions()*GetHistory(index)[t].Action;
 	}
-        QNODE& qnode = vnode->Child(action);
-        qnode.AMAF.Add(totalReward, totalDiscount);
+        AddValue(vnode->ActionAMAF(action), totalReward, totalDiscount);
         totalDiscount *= Params.RaveDiscount;
     }
 }
 
+int MCTS::GetNumNodeActions(const int& index) const
+{
+    int slot = index == 0 ? index : index-1;
+    return Params.MultiAgent && !Params.JointQActions[slot] ? Simulator.GetNumAgentActions() :
+			Simulator.GetNumActions();
+}
+
+int MCTS::GetNumNodeBuckets(const int& index) const
+{
+    // Most QNODEs in large action spaces never see a child, so need few buckets
+    int numObservations = index == 0 ? Simulator.GetNumObservations() : Simulator.GetNumAgentObservations();
+    int numBuckets = std::min(numObservations, QNODE::MaxBuckets);
+    return std::max(1, std::min(numBuckets, QNODE::MaxNodeBuckets / GetNumNodeActions(index)));
+}
+
+VNODE* MCTS::CreateNode(const int& index) const
+{
+    int slot = index == 0 ? index : index-1;
+    return VNODE::Create(NodePool(index), GetNumNodeActions(index), GetNumNodeBuckets(index),
+	Params.RewardAdaptive[slot] ? 1 : 0);
+}
+
+size_t MCTS::GetNodeBytes(const int& index) const
+{
+    return VNODE::GetBytes(GetNumNodeActions(index), GetNumNodeBuckets(index));
+}
+
+void MCTS::GetThreadAllocations(const int& index, std::vector<long long>& allocations) const
+{
+    if (Master)
+    {
+	Master->GetThreadAllocations(index, allocations);
+	return;
+    }
+    int slot = index == 0 ? index : index-1;
+    allocations.assign(MEMORY_THREAD::MaxThreads + 1, 0);
+    for (int arena = 2 * slot; arena < 2 * slot + 2; arena++)
+	for (int i = 0; i <= MEMORY_THREAD::MaxThreads; i++)
+	    allocations[i] += Arenas[arena]->GetThreadStatistics(i).Allocations;
+    while (!allocations.empty() && allocations.back() == 0)
+	allocations.pop_back();
+}
+
+MEMORY_POOL<VNODE>& MCTS::NodePool(const int& index) const
+{
+    if (Master)
+	return Master->NodePool(index);
+    int slot = index == 0 ? index : index-1;
+    return *Arenas[2 * slot + CurrentArenas[slot]];
+}
+
+void MCTS::Reclaim(const int& index, VNODE* root, MEMORY_POOL<VNODE>* arena, bool reset)
+{
+    // Search only adds particles to the root and the nodes one step below
+    // it, but reward adaptive nodes all hold their own reward samples
+    int beliefDepth = Params.RewardAdaptive[index == 0 ? index : index-1] ? -1 : 1;
+    WaitReclaim(index);
+    if (Params.BackgroundReclaim)
+	Reclaimers[index == 0 ? index : index-1] = std::thread(&MCTS::ReleaseTree, this, root, arena, reset, beliefDepth);
+    else
+	ReleaseTree(root, arena, reset, beliefDepth);
+}
+
+void MCTS::ReleaseTree(VNODE* root, MEMORY_POOL<VNODE>* arena, bool reset, int beliefDepth) const
+{
+    // Particles belong to the simulator, so are always freed one by one
+    if (reset)
+    {
+	VNODE::FreeBeliefs(root, Simulator, beliefDepth);
+	arena->Reset();
+    }
+    else
+	VNODE::Free(root, Simulator, *arena);
+}
+
+void MCTS::WaitReclaim(const int& index)
+{
+    std::thread& reclaimer = Reclaimers[index == 0 ? index : index-1];
+    if (reclaimer.joinable())
+	reclaimer.join();
+}
+
 VNODE* MCTS::ExpandNode(const STATE* state, const int& perspindex, const int& agentindex)
 {
-    VNODE* vnode = VNODE::Create();
+    VNODE* vnode = CreateNode(perspindex);
     vnode->Value.Set(0, 0);
     
     if (!Params.MultiAgent)
@@ -802,7 +1171,10 @@ VNODE* MCTS::ExpandNode(const STATE* state, const int& perspindex, const int& ag
 void MCTS::AddSample(VNODE* node, const STATE& state)
 {
     STATE* sample = Simulator.Copy(state);
-    node->Beliefs().AddSample(sample);
+    if (SharedTree)
+	node->Beliefs().AtomicAddSample(sample);
+    else
+	node->Beliefs().AddSample(sample);
     if (Params.Verbose >= 2)
     {
         cout << "Adding sample:" << endl;
@@ -810,10 +1182,277 @@ void MCTS::AddSample(VNODE* node, const STATE& state)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Vectorised UCB selection. VALUE<int> is {int Count; double Total} and
+// VALUE<double> is {double Count; double Total}, both 16 bytes, so a pair
+// of actions is unpacked into a register of counts and one of totals.
+// Every lane does the same IEEE operations as the scalar loop, so scores
+// (and so the selected actions) are identical with and without SIMD.
+
+static_assert(sizeof(VALUE<int>) == 2 * sizeof(double), "VALUE<int> layout");
+static_assert(sizeof(VALUE<double>) == 2 * sizeof(double), "VALUE<double> layout");
+
+// Bonuses for a whole register are read from the cache row when every
+// child count is within it, and computed otherwise
+static inline bool InCacheRow(const double* row, const VALUE<int>* values, int width, int cols)
+{
+    if (!row)
+	return false;
+    for (int i = 0; i < width; i++)
+	if (values[i].GetCount() >= cols)
+	    return false;
+    return true;
+}
+
+#if defined(__AVX2__)
+
+static const int UCB_WIDTH = 4;
+
+static inline void UnpackValues(const void* v, __m256d& counts, __m256d& totals)
+{
+    __m256d v01 = _mm256_loadu_pd((const double*) v);
+    __m256d v23 = _mm256_loadu_pd((const double*) v + 4);
+    // Lanes are [0, 2, 1, 3] after unpacking
+    counts = _mm256_permute4x64_pd(_mm256_unpacklo_pd(v01, v23), _MM_SHUFFLE(3, 1, 2, 0));
+    totals = _mm256_permute4x64_pd(_mm256_unpackhi_pd(v01, v23), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static inline void UnpackValues(const VALUE<int>* v, __m256d& counts, __m256d& totals)
+{
+    __m256d packed;
+    UnpackValues((const void*) v, packed, totals);
+    // Integer counts are in the low half of each lane
+    __m256i ints = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(packed),
+	_mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0));
+    counts = _mm256_cvtepi32_pd(_mm256_castsi256_si128(ints));
+}
+
+static inline void ScoreActionsSIMD(const VALUE<int>* values, const VALUE<double>* amafs,
+    int numActions, bool ucb, double c, double logN, double raveConstant,
+    const double* row, int cols, long long& hits, long long& misses, double* scores)
+{
+    const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+    const __m256d vc = _mm256_set1_pd(c), vlogN = _mm256_set1_pd(logN);
+    const __m256d vinf = _mm256_set1_pd(Infinity), vrave = _mm256_set1_pd(raveConstant);
+    for (int a = 0; a + UCB_WIDTH <= numActions; a += UCB_WIDTH)
+    {
+	__m256d n, total;
+	UnpackValues(values + a, n, total);
+	__m256d unvisited = _mm256_cmp_pd(n, zero, _CMP_EQ_OQ);
+	__m256d safen = _mm256_blendv_pd(n, one, unvisited);
+	__m256d q = _mm256_div_pd(total, safen);
+
+	if (amafs)
+	{
+	    __m256d n2, total2;
+	    UnpackValues((const void*) (amafs + a), n2, total2);
+	    __m256d seen = _mm256_cmp_pd(n2, zero, _CMP_GT_OQ);
+	    __m256d beta = _mm256_div_pd(n2, _mm256_add_pd(_mm256_add_pd(n, n2),
+		_mm256_mul_pd(_mm256_mul_pd(vrave, n), n2)));
+	    __m256d amaf = _mm256_div_pd(total2, _mm256_blendv_pd(one, n2, seen));
+	    __m256d blend = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(one, beta), q),
+		_mm256_mul_pd(beta, amaf));
+	    q = _mm256_blendv_pd(q, blend, seen);
+	}
+
+	if (ucb && InCacheRow(row, values + a, UCB_WIDTH, cols))
+	{
+	    q = _mm256_add_pd(q, _mm256_setr_pd(row[values[a].GetCount()], row[values[a + 1].GetCount()],
+		row[values[a + 2].GetCount()], row[values[a + 3].GetCount()]));
+	    hits += UCB_WIDTH;
+	}
+	else if (ucb)
+	{
+	    __m256d bonus = _mm256_mul_pd(vc, _mm256_sqrt_pd(_mm256_div_pd(vlogN, safen)));
+	    q = _mm256_add_pd(q, _mm256_blendv_pd(bonus, vinf, unvisited));
+	    misses += UCB_WIDTH;
+	}
+	_mm256_storeu_pd(scores + a, q);
+    }
+}
+
+static inline double MaxScoreSIMD(const double* scores, int numActions)
+{
+    __m256d best = _mm256_set1_pd(-Infinity);
+    for (int a = 0; a + UCB_WIDTH <= numActions; a += UCB_WIDTH)
+	best = _mm256_max_pd(best, _mm256_loadu_pd(scores + a));
+    __m128d half = _mm_max_pd(_mm256_castpd256_pd128(best), _mm256_extractf128_pd(best, 1));
+    return _mm_cvtsd_f64(_mm_max_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+static inline int MatchScoreSIMD(const double* scores, int a, double bestq)
+{
+    return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(scores + a), 
+	_mm256_set1_pd(bestq), _CMP_EQ_OQ));
+}
+
+#elif defined(__SSE2__)
+
+static const int UCB_WIDTH = 2;
+
+static inline __m128d Select(__m128d mask, __m128d a, __m128d b)
+{
+    return _mm_or_pd(_mm_and_pd(mask, b), _mm_andnot_pd(mask, a));
+}
+
+static inline void UnpackValues(const VALUE<double>* v, __m128d& counts, __m128d& totals)
+{
+    __m128d v0 = _mm_loadu_pd((const double*) v);
+    __m128d v1 = _mm_loadu_pd((const double*) (v + 1));
+    counts = _mm_unpacklo_pd(v0, v1);
+    totals = _mm_unpackhi_pd(v0, v1);
+}
+
+static inline void UnpackValues(const VALUE<int>* v, __m128d& counts, __m128d& totals)
+{
+    __m128i v0 = _mm_loadu_si128((const __m128i*) v);
+    __m128i v1 = _mm_loadu_si128((const __m128i*) (v + 1));
+    counts = _mm_cvtepi32_pd(_mm_unpacklo_epi32(v0, v1));
+    totals = _mm_unpackhi_pd(_mm_castsi128_pd(v0), _mm_castsi128_pd(v1));
+}
+
+static inline void ScoreActionsSIMD(const VALUE<int>* values, const VALUE<double>* amafs,
+    int numActions, bool ucb, double c, double logN, double raveConstant,
+    const double* row, int cols, long long& hits, long long& misses, double* scores)
+{
+    const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+    const __m128d vc = _mm_set1_pd(c), vlogN = _mm_set1_pd(logN);
+    const __m128d vinf = _mm_set1_pd(Infinity), vrave = _mm_set1_pd(raveConstant);
+    for (int a = 0; a + UCB_WIDTH <= numActions; a += UCB_WIDTH)
+    {
+	__m128d n, total;
+	UnpackValues(values + a, n, total);
+	__m128d unvisited = _mm_cmpeq_pd(n, zero);
+	__m128d safen = Select(unvisited, n, one);
+	__m128d q = _mm_div_pd(total, safen);
+
+	if (amafs)
+	{
+	    __m128d n2, total2;
+	    UnpackValues(amafs + a, n2, total2);
+	    __m128d seen = _mm_cmpgt_pd(n2, zero);
+	    __m128d beta = _mm_div_pd(n2, _mm_add_pd(_mm_add_pd(n, n2),
+		_mm_mul_pd(_mm_mul_pd(vrave, n), n2)));
+	    __m128d amaf = _mm_div_pd(total2, Select(seen, one, n2));
+	    __m128d blend = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(one, beta), q),
+		_mm_mul_pd(beta, amaf));
+	    q = Select(seen, q, blend);
+	}
+
+	if (ucb && InCacheRow(row, values + a, UCB_WIDTH, cols))
+	{
+	    q = _mm_add_pd(q, _mm_setr_pd(row[values[a].GetCount()], row[values[a + 1].GetCount()]));
+	    hits += UCB_WIDTH;
+	}
+	else if (ucb)
+	{
+	    __m128d bonus = _mm_mul_pd(vc, _mm_sqrt_pd(_mm_div_pd(vlogN, safen)));
+	    q = _mm_add_pd(q, Select(unvisited, bonus, vinf));
+	    misses += UCB_WIDTH;
+	}
+	_mm_storeu_pd(scores + a, q);
+    }
+}
+
+static inline double MaxScoreSIMD(const double* scores, int numActions)
+{
+    __m128d best = _mm_set1_pd(-Infinity);
+    for (int a = 0; a + UCB_WIDTH <= numActions; a += UCB_WIDTH)
+	best = _mm_max_pd(best, _mm_loadu_pd(scores + a));
+    return _mm_cvtsd_f64(_mm_max_sd(best, _mm_unpackhi_pd(best, best)));
+}
+
+static inline int MatchScoreSIMD(const double* scores, int a, double bestq)
+{
+    return _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(scores + a), _mm_set1_pd(bestq)));
+}
+
+#else
+
+// No SIMD, everything is scored by the scalar loop
+static const int UCB_WIDTH = 1;
+
+#endif
+
+void MCTS::ScoreActions(const VNODE* vnode, int numActions, bool ucb, const int& index, bool vectorise) const
+{
+    Scores.resize(numActions);
+    int N = vnode->Value.GetCount();
+    double logN = log(N + 1);
+    int first = 0;
+    if (ucb)
+	GrowUCB(index, N);
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    if (vectorise)
+    {
+	const UCB_CACHE& cache = GetUCBCache(index);
+	ScoreActionsSIMD(&vnode->ActionValue(0), Params.UseRave ? &vnode->ActionAMAF(0) : 0,
+	    numActions, ucb, cache.ExplorationConstant, logN, Params.RaveConstant,
+	    N < cache.Rows ? &cache.Bonus[N * UCB_n] : 0, UCB_n,
+	    UCBHits[index == 0 ? index : index-1], UCBMisses[index == 0 ? index : index-1], &Scores[0]);
+	first = numActions - numActions % UCB_WIDTH;
+    }
+#endif
+
+    for (int action = first; action < numActions; action++)
+    {
+	const VALUE<int>& value = vnode->ActionValue(action);
+	double q = value.GetValue();
+	int n = value.GetCount();
+
+	if (Params.UseRave && vnode->ActionAMAF(action).GetCount() > 0)
+	{
+	    const VALUE<double>& amaf = vnode->ActionAMAF(action);
+	    double n2 = amaf.GetCount();
+	    double beta = n2 / (n + n2 + Params.RaveConstant * n * n2);
+	    q = (1.0 - beta) * q + beta * amaf.GetValue();
+	}
+
+	if (ucb)
+	    q += FastUCB(N, n, logN, index);
+	Scores[action] = q;
+    }
+}
+
+int MCTS::SelectUCB(const VNODE* vnode, int numActions, bool ucb, const int& index, bool vectorise) const
+{
+    ScoreActions(vnode, numActions, ucb, index, vectorise);
+    vector<int>& besta = BestActions;
+    besta.clear();
+    double bestq = -Infinity;
+    int first = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    if (vectorise)
+    {
+	first = numActions - numActions % UCB_WIDTH;
+	bestq = MaxScoreSIMD(&Scores[0], numActions);
+    }
+#endif
+
+    for (int action = first; action < numActions; action++)
+	bestq = max(bestq, Scores[action]);
+
+    // Ties are collected in action order, then broken at random
+#if defined(__AVX2__) || defined(__SSE2__)
+    if (vectorise)
+	for (int a = 0; a < first; a += UCB_WIDTH)
+	    for (int mask = MatchScoreSIMD(&Scores[0], a, bestq); mask; mask &= mask - 1)
+		besta.push_back(a + __builtin_ctz(mask));
+#endif
+
+    for (int action = first; action < numActions; action++)
+	if (Scores[action] == bestq)
+	    besta.push_back(action);
+
+    assert(!besta.empty());
+    return besta[Random(besta.size())];
+}
 
 int MCTS::GreedyUCB(VNODE* vnode, bool ucb, const int& index) const
 {
-    static vector<int> besta;
+    vector<int>& besta = BestActions;
     besta.clear();
     double bestq = -Infinity;
     int N = vnode->Value.GetCount();
@@ -829,6 +1468,16 @@ int MCTS::GreedyUCB(VNODE* vnode, bool ucb, const int& index) const
     else
 	maxIter = Simulator.GetNumActions();
     
+    // Most nodes are scored from their value and AMAF statistics alone.
+    // The vector loads are not atomic, so nodes other threads are updating
+    // are scored one action at a time.
+    if (!hasalpha &&
+	!(Params.MinMax[index == 0 ? index : index-1] && Params.JointQActions[index == 0 ? index : index-1]) &&
+	!(Params.MultiAgent && Params.RewardAdaptive[index == 0 ? index : index-1] && 
+	  Statuses[index == 0 ? index : index-1].LearningPhase))
+	return SelectUCB(vnode, maxIter, ucb, index, !SharedTree);
+    if (ucb)
+	GrowUCB(index, N);
     
     std::vector<int> maxOwnActions;
     std::vector<int> maxOtherActions;
@@ -871,14 +1520,16 @@ int MCTS::GreedyUCB(VNODE* vnode, bool ucb, const int& index) const
 	    int othern, otheralphan;
 	    
 	    QNODE& qnode = vnode->Child(treeaction);
-	    q = qnode.Value.GetValue();
-	    n = qnode.Value.GetCount();
+	    const VALUE<int>& value = vnode->ActionValue(treeaction);
+	    q = value.GetValue();
+	    n = value.GetCount();
 
-	    if (Params.UseRave && qnode.AMAF.GetCount() > 0)
+	    if (Params.UseRave && vnode->ActionAMAF(treeaction).GetCount() > 0)
 	    {
-		double n2 = qnode.AMAF.GetCount();
+		const VALUE<double>& amaf = vnode->ActionAMAF(treeaction);
+		double n2 = amaf.GetCount();
 		double beta = n2 / (n + n2 + Params.RaveConstant * n * n2);
-		q = (1.0 - beta) * q + beta * qnode.AMAF.GetValue();
+		q = (1.0 - beta) * q + beta * amaf.GetValue();
 	    }
 
 	    if (hasalpha && n > 0)
@@ -890,7 +1541,7 @@ int MCTS::GreedyUCB(VNODE* vnode, bool ucb, const int& index) const
 	    }
 	    
 	    if (ucb)
-		q += FastUCB(N, n, logN);
+		q += FastUCB(N, n, logN, index);
 	    
 	    if (Params.MultiAgent && 
 		Params.RewardAdaptive[index == 0 ? index : index-1] && Statuses[index == 0 ? index : index-1].LearningPhase) 
@@ -1090,31 +1741,61 @@ STATE* MCTS::CreateTransform(const int& index) const
     return 0;
 }
 
-double MCTS::UCB[UCB_N][UCB_n];
-bool MCTS::InitialisedFastUCB = true;
+double MCTS::ExplorationConstant(const int& index) const
+{
+    return GetUCBCache(index).ExplorationConstant;
+}
+
+const int MCTS::UCB_N, MCTS::UCB_n;
 
-void MCTS::InitFastUCB(double exploration)
+const MCTS::UCB_CACHE& MCTS::GetUCBCache(const int& index) const
 {
-    cout << "Initialising fast UCB table... ";
-    for (int N = 0; N < UCB_N; ++N)
-        for (int n = 0; n < UCB_n; ++n)
-            if (n == 0)
-                UCB[N][n] = Infinity;
-            else
-                UCB[N][n] = exploration * sqrt(log(N + 1) / n);
-    cout << "done" << endl;
-    InitialisedFastUCB = true;
+    // Workers use the master's cache
+    const MCTS& owner = Master ? *Master : *this;
+    return owner.UCBCaches[index == 0 ? index : index-1];
 }
 
-inline double MCTS::FastUCB(int N, int n, double logN) const
+void MCTS::GrowUCB(const int& index, int N) const
 {
-    if (InitialisedFastUCB && N < UCB_N && n < UCB_n)
-        return UCB[N][n];
+    // Rows at least double, so a search reaching N fills them O(log N) times.
+    // Workers have no caches of their own, and read the master's.
+    if (Worker)
+	return;
+    UCB_CACHE& cache = UCBCaches[index == 0 ? index : index-1];
+    if (N < cache.Rows || cache.Rows == UCB_N)
+	return;
+    int rows = min(UCB_N, max(N + 1, 2 * cache.Rows));
+    cache.Bonus.resize(rows * UCB_n);
+    for (int row = cache.Rows; row < rows; ++row)
+    {
+	cache.Bonus[row * UCB_n] = Infinity;
+	for (int n = 1; n < UCB_n; ++n)
+	    cache.Bonus[row * UCB_n + n] = cache.ExplorationConstant * sqrt(log(row + 1) / n);
+    }
+    cache.Rows = rows;
+}
 
+inline double MCTS::FastUCB(int N, int n, double logN, const int& index) const
+{
+    const UCB_CACHE& cache = GetUCBCache(index);
+    if (N < cache.Rows && n < UCB_n)
+    {
+	UCBHits[index == 0 ? index : index-1]++;
+	return cache.Bonus[N * UCB_n + n];
+    }
+
+    UCBMisses[index == 0 ? index : index-1]++;
     if (n == 0)
         return Infinity;
     else
-        return Params.ExplorationConstant * sqrt(logN / n);
+        return cache.ExplorationConstant * sqrt(logN / n);
+}
+
+double MCTS::GetUCBHitRate(const int& index) const
+{
+    long long hits = UCBHits[index == 0 ? index : index-1];
+    long long total = hits + UCBMisses[index == 0 ? index : index-1];
+    return total == 0 ? 0.0 : (double) hits / total;
 }
 
 void MCTS::ClearStatistics(const int& index)
@@ -1124,6 +1805,13 @@ void MCTS::ClearStatistics(const int& index)
     StatTotalRewards[index == 0 ? index : index-1].Clear();
 }
 
+void MCTS::MergeStatistics(const MCTS& worker, const int& index)
+{
+    StatTreeDepths[index == 0 ? index : index-1].Merge(worker.StatTreeDepths[index == 0 ? index : index-1]);
+    StatRolloutDepths[index == 0 ? index : index-1].Merge(worker.StatRolloutDepths[index == 0 ? index : index-1]);
+    StatTotalRewards[index == 0 ? index : index-1].Merge(worker.StatTotalRewards[index == 0 ? index : index-1]);
+}
+
 void MCTS::DisplayStatistics(ostream& ostr, const int& index) const
 {
     if (Params.Verbose >= 1)
@@ -1131,13 +1819,18 @@ void MCTS::DisplayStatistics(ostream& ostr, const int& index) const
 	StatTreeDepths[index == 0 ? index : index-1].Print("Tree depth", ostr);
 	StatRolloutDepths[index == 0 ? index : index-1].Print("Rollout depth", ostr);
 	StatTotalRewards[index == 0 ? index : index-1].Print("Total reward", ostr);
+	if (Params.DoFastUCB)
+	    ostr << "UCB cache hit rate: " << GetUCBHitRate(index) << endl;
+	const MEMORY_POOL<VNODE>& pool = NodePool(index);
+	ostr << "Tree nodes: " << pool.GetNumAllocated() << " live, " << pool.GetPeakAllocated() 
+	    << " peak, " << pool.GetBytesReserved() << " bytes reserved" << endl;
     }
 
     if (Params.Verbose >= 2)
     {
-        ostr << "Policy after " << Params.NumSimulations << " simulations" << endl;
+        ostr << "Policy after " << GetSimulationCount(index) << " simulations" << endl;
         DisplayPolicy(6, index, ostr);
-        ostr << "Values after " << Params.NumSimulations << " simulations" << endl;
+        ostr << "Values after " << GetSimulationCount(index) << " simulations" << endl;
         DisplayValue(6, index, ostr);
     }
 }
@@ -1180,6 +1873,9 @@ void MCTS::UnitTest(const int& index)
     UnitTestRollout(index);
     for (int depth = 1; depth <= 3; ++depth)
         UnitTestSearch(depth, index);
+    UnitTestReentrant(index);
+    UnitTestVectorUCB(index);
+    UnitTestUCBCache(index);
 }
 
 void MCTS::UnitTestGreedy(const int& index)
@@ -1192,10 +1888,10 @@ void MCTS::UnitTestGreedy(const int& index)
 
     VNODE* vnode = mcts.ExpandNode(testSimulator.CreateStartState(), index, index);
     vnode->Value.Set(1, 0);
-    vnode->Child(0).Value.Set(0, 1);
+    vnode->Child(0).Value().Set(1, 1);
     for (int action = 1; action < numAct; action++)
-        vnode->Child(action).Value.Set(0, 0);
-    assert(mcts.GreedyUCB(vnode, false) == 0);
+        vnode->Child(action).Value().Set(0, 0);
+    assert(mcts.GreedyUCB(vnode, false, index) == 0);
 }
 
 void MCTS::UnitTestUCB(const int& index)
@@ -1211,40 +1907,40 @@ void MCTS::UnitTestUCB(const int& index)
     vnode1->Value.Set(1, 0);
     for (int action = 0; action < numAct; action++)
         if (action == 3)
-            vnode1->Child(action).Value.Set(99, 0);
+            vnode1->Child(action).Value().Set(99, 0);
         else
-            vnode1->Child(action).Value.Set(100 + action, 0);
-    assert(mcts.GreedyUCB(vnode1, true) == 3);
+            vnode1->Child(action).Value().Set(100 + action, 0);
+    assert(mcts.GreedyUCB(vnode1, true, index) == 3);
 
     // With high counts, action with highest value is selected
     VNODE* vnode2 = mcts.ExpandNode(testSimulator.CreateStartState(), index, index);
     vnode2->Value.Set(1, 0);
     for (int action = 0; action < numAct; action++)
         if (action == 3)
-            vnode2->Child(action).Value.Set(99 + numObs, 1);
+            vnode2->Child(action).Value().Set(99 + numObs, 1);
         else
-            vnode2->Child(action).Value.Set(100 + numAct - action, 0);
-    assert(mcts.GreedyUCB(vnode2, true) == 3);
+            vnode2->Child(action).Value().Set(100 + numAct - action, 0);
+    assert(mcts.GreedyUCB(vnode2, true, index) == 3);
 
     // Action with low value and low count beats actions with high counts
     VNODE* vnode3 = mcts.ExpandNode(testSimulator.CreateStartState(), index, index);
     vnode3->Value.Set(1, 0);
     for (int action = 0; action < numAct; action++)
         if (action == 3)
-            vnode3->Child(action).Value.Set(1, 1);
+            vnode3->Child(action).Value().Set(1, 1);
         else
-            vnode3->Child(action).Value.Set(100 + action, 1);
-    assert(mcts.GreedyUCB(vnode3, true) == 3);
+            vnode3->Child(action).Value().Set(100 + action, 1);
+    assert(mcts.GreedyUCB(vnode3, true, index) == 3);
 
     // Actions with zero count is always selected
     VNODE* vnode4 = mcts.ExpandNode(testSimulator.CreateStartState(), index, index);
     vnode4->Value.Set(1, 0);
     for (int action = 0; action < numAct; action++)
         if (action == 3)
-            vnode4->Child(action).Value.Set(0, 0);
+            vnode4->Child(action).Value().Set(0, 0);
         else
-            vnode4->Child(action).Value.Set(1, 1);
-    assert(mcts.GreedyUCB(vnode4, true) == 3);
+            vnode4->Child(action).Value().Set(1, 1);
+    assert(mcts.GreedyUCB(vnode4, true, index) == 3);
 }
 
 void MCTS::UnitTestRollout(const int& index)
@@ -1280,4 +1976,116 @@ void MCTS::UnitTestSearch(int depth, const int& index)
     assert(fabs(optimalValue - rootValue) < 0.1);
 }
 
+void MCTS::UnitTestReentrant(const int& index)
+{
+    // Two planners with different sizes and exploration search concurrently
+    TEST_SIMULATOR testSimulator1(3, 2, 2), testSimulator2(4, 3, 2);
+    PARAMS params1, params2;
+    params1.MaxDepth = params2.MaxDepth = 3;
+    params1.NumSimulations = 1000;
+    params2.NumSimulations = 10000;
+    params2.ExplorationConstant = 2;
+    MCTS mcts1(testSimulator1, params1), mcts2(testSimulator2, params2);
+    std::thread thread1(&MCTS::UCTSearch, &mcts1, index);
+    std::thread thread2(&MCTS::UCTSearch, &mcts2, index);
+    thread1.join();
+    thread2.join();
+    double rootValue1 = mcts1.Roots[index == 0 ? index : index-1]->Value.GetValue();
+    double rootValue2 = mcts2.Roots[index == 0 ? index : index-1]->Value.GetValue();
+    assert(fabs(testSimulator1.OptimalValue() - rootValue1) < 0.1);
+    assert(fabs(testSimulator2.OptimalValue() - rootValue2) < 0.1);
+}
+
+void MCTS::UnitTestVectorUCB(const int& index)
+{
+    // SIMD and scalar scores agree exactly, including the tail actions
+    for (int numAct = 1; numAct <= 9; numAct++)
+    {
+        TEST_SIMULATOR testSimulator(numAct, 2, 0);
+        PARAMS params;
+        params.UseRave = true;
+        MCTS mcts(testSimulator, params);
+        VNODE* vnode = mcts.ExpandNode(testSimulator.CreateStartState(), index, index);
+        vnode->Value.Set(1000, 0);
+        for (int action = 0; action < numAct; action++)
+        {
+            vnode->Child(action).Value().Set(Random(3), RandomDouble(-10, 10));
+            vnode->Child(action).AMAF().Set(Random(3), RandomDouble(-10, 10));
+        }
+        for (int ucb = 0; ucb < 2; ucb++)
+        {
+            mcts.ScoreActions(vnode, numAct, ucb, index, false);
+            vector<double> scalar = mcts.Scores;
+            mcts.ScoreActions(vnode, numAct, ucb, index, true);
+            assert(mcts.Scores == scalar);
+        }
+    }
+}
+
+void MCTS::UnitTestUCBCache(const int& index)
+{
+    int slot = index == 0 ? index : index-1;
+    TEST_SIMULATOR testSimulator(5, 5, 0);
+    PARAMS params;
+    params.AgentExploration[slot] = 3;
+    MCTS mcts(testSimulator, params);
+    assert(mcts.UCBCaches[slot].Rows == 0);
+
+    // Rows are added on demand, for the agent's own exploration constant
+    mcts.GrowUCB(index, 50);
+    assert(mcts.UCBCaches[slot].Rows == 51);
+    assert(mcts.FastUCB(50, 7, log(51), index) == 3 * sqrt(log(51) / 7));
+    assert(mcts.FastUCB(50, 0, log(51), index) == Infinity);
+    assert(mcts.FastUCB(50, UCB_n, log(51), index) == 3 * sqrt(log(51) / UCB_n));
+    assert(mcts.FastUCB(UCB_N, 1, log(UCB_N + 1), index) == 3 * sqrt(log(UCB_N + 1)));
+    assert(mcts.GetUCBHitRate(index) == 0.5);
+}
+
+void MCTS::BenchmarkUCB(ostream& ostr)
+{
+    const int sizes[] = { 5, 13, 300 };
+    ostr << "Actions\tRAVE\tScalar/s\tSIMD/s\tSpeedup" << endl;
+    for (int i = 0; i < 3; i++)
+    {
+        int size = sizes[i];
+        for (int rave = 0; rave < 2; rave++)
+        {
+            TEST_SIMULATOR testSimulator(size, 2, 0);
+            PARAMS params;
+            params.UseRave = rave;
+            MCTS mcts(testSimulator, params);
+            VNODE* vnode = mcts.ExpandNode(testSimulator.CreateStartState(), 0, 0);
+            vnode->Value.Set(10000, 0);
+            for (int action = 0; action < size; action++)
+            {
+                vnode->Child(action).Value().Set(Random(1, 200), RandomDouble(-10, 10));
+                vnode->Child(action).AMAF().Set(Random(1, 200), RandomDouble(-10, 10));
+            }
+
+            double rates[2];
+            // Keeps the selections from being optimised away
+            volatile int sink = 0;
+            for (int vectorise = 0; vectorise < 2; vectorise++)
+            {
+                auto start = chrono::steady_clock::now();
+                chrono::duration<double> elapsed;
+                long selections = 0;
+                do
+                {
+                    for (int j = 0; j < 1000; j++)
+                        sink += mcts.SelectUCB(vnode, size, true, 0, vectorise);
+                    selections += 1000;
+                    elapsed = chrono::steady_clock::now() - start;
+                }
+                while (elapsed.count() < 0.25);
+                rates[vectorise] = selections / elapsed.count();
+            }
+
+            ostr << size << "\t" << (rave ? "yes" : "no") << "\t"
+                << rates[0] << "\t" << rates[1] << "\t"
+                << rates[1] / rates[0] << endl;
+        }
+    }
+}
+
 //-----------------------------------------------------------------------------
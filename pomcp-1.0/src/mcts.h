@@ -4,6 +4,9 @@
 #include "simulator.h"
 #include "node.h"
 #include "statistic.h"
+#include <mutex>
+#include <chrono>
+#include <thread>
 
 class MCTS
 {
@@ -24,6 +27,7 @@ public:
         int MaxAttempts;
         int ExpandCount;
         double ExplorationConstant;
+	std::vector<double> AgentExploration; // per agent, negative to use ExplorationConstant
         bool UseRave;
         double RaveDiscount;
         double RaveConstant;
@@ -38,6 +42,12 @@ public:
 	double InitialRewardWeight;
 	int MultiAgentPriorCount;
 	double MultiAgentPriorValue;
+	int NumThreads;
+	bool TreeParallel;
+	double VirtualLoss;
+	double TimeLimit; // seconds per search, 0 for no deadline
+	bool ReuseTree;
+	bool BackgroundReclaim;
     };
     
     MCTS(const SIMULATOR& simulator, const PARAMS& params);
@@ -63,12 +73,29 @@ public:
     void DisplayPolicy(int depth, const int& index, std::ostream& ostr) const;
     
     void DisplaySequence(std::vector<int> sequence, const int& index) const;
+    
+    // Simulations completed by the last search, which may stop early on TimeLimit
+    int GetSimulationCount(const int& index) const { return SimulationCounts[index == 0 ? index : index-1]; }
+    // Nodes allocated to the agent's current tree
+    int GetTreeSize(const int& index) const { return NodePool(index).GetNumAllocated(); }
+    // Bytes held by each node of the agent's tree
+    size_t GetNodeBytes(const int& index) const;
+    // Nodes allocated for the agent's trees by each pool thread, indexed by
+    // MEMORY_THREAD id, over the life of the search
+    void GetThreadAllocations(const int& index, std::vector<long long>& allocations) const;
+    // Fraction of exploration bonuses found in the UCB cache, over all searches
+    double GetUCBHitRate(const int& index) const;
 
     static void UnitTest(const int& index);
-    static void InitFastUCB(double exploration);
+    // Times action selection on expanded nodes with 5, 13 and 300 actions
+    static void BenchmarkUCB(std::ostream& ostr);
 
 private:
 
+    // Worker for parallel search, searching below root, which is either
+    // its own tree (root parallel) or shared with other workers (tree parallel)
+    MCTS(const MCTS& master, const int& index, VNODE* root, bool sharedTree);
+
     const SIMULATOR& Simulator;
     int TreeDepth, PeakTreeDepth;
     PARAMS Params;
@@ -81,8 +108,45 @@ private:
     std::vector<STATISTIC> StatTreeDepths;
     std::vector<STATISTIC> StatRolloutDepths;
     std::vector<STATISTIC> StatTotalRewards;
+    std::vector<int> SimulationCounts;
+    std::chrono::steady_clock::time_point Deadline;
+    bool Worker, SharedTree;
+    uint64_t StreamSeed; // workers draw from their own random stream
+    int Stream;
+    const MCTS* Master;
+
+    // Each agent's tree is allocated from one of two arenas, owned by the
+    // master so workers can share them. When Update drops a whole tree, the
+    // new root starts in the other arena and the old one is Reset at once.
+    std::vector<MEMORY_POOL<VNODE>*> Arenas;
+    std::vector<int> CurrentArenas;
+    std::vector<std::thread> Reclaimers;
+    mutable std::vector<int> BestActions;
+    mutable std::vector<double> Scores;
+    
+    MEMORY_POOL<VNODE>& NodePool(const int& index) const;
+    int GetNumNodeActions(const int& index) const;
+    int GetNumNodeBuckets(const int& index) const;
+    VNODE* CreateNode(const int& index) const;
+    void FreeNode(VNODE* vnode, const int& index) const { VNODE::Free(vnode, Simulator, NodePool(index)); }
+    void Reclaim(const int& index, VNODE* root, MEMORY_POOL<VNODE>* arena, bool reset);
+    void ReleaseTree(VNODE* root, MEMORY_POOL<VNODE>* arena, bool reset, int beliefDepth) const;
+    void WaitReclaim(const int& index);
     
+    void StartClock();
+    bool SearchDone(int n) const;
+    void PrepareWorkers(const int& index);
+    int GetNumWorkers() const;
+    void RootParallelSearch(const int& index);
+    void TreeParallelSearch(const int& index);
+    void MergeWorkerRoot(VNODE* root, VNODE* workerRoot, const VNODE* base);
+    // Workers clear their statistics when they start, so each search's are merged once
+    void MergeStatistics(const MCTS& worker, const int& index);
     int GreedyUCB(VNODE* vnode, bool ucb, const int& index) const;
+    // Selection for nodes scored from their own statistics, using SIMD
+    // when vectorise is set and the target supports it
+    int SelectUCB(const VNODE* vnode, int numActions, bool ucb, const int& index, bool vectorise) const;
+    void ScoreActions(const VNODE* vnode, int numActions, bool ucb, const int& index, bool vectorise) const;
     int SelectRandom() const;
     double SimulateV(STATE& state, VNODE* vnode, const int& index, double otherTotalReward);
     double SimulateQ(STATE& state, QNODE& qnode, int action, const int& index, double otherTotalReward);
@@ -93,17 +157,52 @@ private:
     STATE* CreateTransform(const int& index) const;
     void Resample(BELIEF_STATE& beliefs);
 
-    // Fast lookup table for UCB
-    static const int UCB_N = 10000, UCB_n = 100;
-    static double UCB[UCB_N][UCB_n];
-    static bool InitialisedFastUCB;
+    // Exploration bonus cache for one agent, in rows of UCB_n child counts
+    // per parent count N. Rows are added as searches first reach them, by
+    // the master only, so workers read their master's cache without locks.
+    struct UCB_CACHE
+    {
+        double ExplorationConstant;
+        int Rows;
+        std::vector<double> Bonus;
+    };
+
+    // Most bonuses are for small counts, and larger tables spill from cache
+    static const int UCB_N = 1024, UCB_n = 64;
+    mutable std::vector<UCB_CACHE> UCBCaches;
+    mutable std::vector<long long> UCBHits, UCBMisses;
+
+    double ExplorationConstant(const int& index) const;
+    const UCB_CACHE& GetUCBCache(const int& index) const;
+    void GrowUCB(const int& index, int N) const;
+    double FastUCB(int N, int n, double logN, const int& index) const;
 
-    double FastUCB(int N, int n, double logN) const;
+    // Updates values atomically when the tree is shared between threads
+    template<class COUNT>
+    void AddValue(VALUE<COUNT>& value, double totalReward, COUNT weight = 1) const
+    {
+        if (SharedTree)
+            value.AtomicAdd(totalReward, weight);
+        else
+            value.Add(totalReward, weight);
+    }
+
+    template<class COUNT>
+    void SubtractValue(VALUE<COUNT>& value, double totalReward) const
+    {
+        if (SharedTree)
+            value.AtomicSubtract(totalReward);
+        else
+            value.Subtract(totalReward);
+    }
 
     static void UnitTestGreedy(const int& index);
     static void UnitTestUCB(const int& index);
     static void UnitTestRollout(const int& index);
     static void UnitTestSearch(int depth, const int& index);
+    static void UnitTestReentrant(const int& index);
+    static void UnitTestVectorUCB(const int& index);
+    static void UnitTestUCBCache(const int& index);
 };
 
 #endif // MCTS_H
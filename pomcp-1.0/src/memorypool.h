@@ -3,6 +3,12 @@
 
 #include <vector>
 #include <ostream>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new>
 
 class MEMORY_OBJECT
 {
@@ -15,16 +21,94 @@ public:
 private:
 
     bool Allocated;
+    MEMORY_OBJECT* NextFree; // links free objects passed between threads
+
+template <class T> friend class MEMORY_POOL;
+};
+
+//-----------------------------------------------------------------------------
+// Small ids for the threads using memory pools, so that every pool can keep
+// one free cache per thread. Ids of finished threads are reused, and any
+// threads beyond MaxThreads share the id MaxThreads.
+
+class MEMORY_THREAD
+{
+public:
+
+    static const int MaxThreads = 64;
+
+    static int Id()
+    {
+        static thread_local MEMORY_THREAD thread;
+        return thread.ThreadId;
+    }
+
+private:
+
+    MEMORY_THREAD() : ThreadId(Acquire()) { }
+    ~MEMORY_THREAD() { Release(ThreadId); }
+
+    static std::mutex& IdMutex() { static std::mutex mutex; return mutex; }
+    static std::vector<int>& FreeIds() { static std::vector<int> ids; return ids; }
+
+    static int Acquire()
+    {
+        static int next = 0;
+        std::lock_guard<std::mutex> lock(IdMutex());
+        if (!FreeIds().empty())
+        {
+            int id = FreeIds().back();
+            FreeIds().pop_back();
+            return id;
+        }
+        return next < MaxThreads ? next++ : MaxThreads;
+    }
+
+    static void Release(int id)
+    {
+        if (id == MaxThreads)
+            return;
+        std::lock_guard<std::mutex> lock(IdMutex());
+        FreeIds().push_back(id);
+    }
+
+    int ThreadId;
 };
 
+//-----------------------------------------------------------------------------
+
+struct MEMORY_STATISTICS
+{
+    long long Allocations, Frees;
+    long long Refills; // batches taken from objects returned by other threads
+    long long Carves;  // batches of objects taken from the chunks
+    long long Spills;  // batches returned for other threads to use
+};
+
+//-----------------------------------------------------------------------------
+// Each thread allocates from and frees to its own cache without locking.
+// A cache that grows past two batches spills a batch onto a lock-free list
+// shared by all threads, and an empty cache takes that whole list, or else
+// a batch of new objects from the chunks under the mutex.
+
 template <class T>
 class MEMORY_POOL
 {
 public:
 
     MEMORY_POOL()
-    : NumAllocated(0)
+    :   ObjectSize(sizeof(T)),
+        ChunkSize(MaxChunkSize),
+        BatchSize(MaxBatchSize),
+        NumUsed(0),
+        PeakUsed(0),
+        PeakChunks(0),
+        NumReset(0),
+        TrimOnReset(false),
+        SharedFree(0)
     {
+        for (int i = 0; i <= MEMORY_THREAD::MaxThreads; ++i)
+            Caches[i].Stats = MEMORY_STATISTICS();
     }
 
     ~MEMORY_POOL()
@@ -44,60 +128,314 @@ public:
         Free(obj);
     }
 
-    T* Allocate() 
-    { 
-        if (FreeList.empty())
-            NewChunk();
-        T* obj = FreeList.back();
-        FreeList.pop_back();
+    T* Allocate()
+    {
+        int id = MEMORY_THREAD::Id();
+        std::unique_lock<std::mutex> lock(OverflowMutex, std::defer_lock);
+        if (id == MEMORY_THREAD::MaxThreads)
+            lock.lock();
+        CACHE& cache = Caches[id];
+        if (cache.Free.empty())
+            Refill(cache);
+        T* obj = cache.Free.back();
+        cache.Free.pop_back();
         assert(!obj->IsAllocated());
         obj->SetAllocated();
-        NumAllocated++;
+        cache.Stats.Allocations++;
         return obj;
     }
-    
-    void Free(T* obj) 
-    { 
+
+    void Free(T* obj)
+    {
+        int id = MEMORY_THREAD::Id();
+        std::unique_lock<std::mutex> lock(OverflowMutex, std::defer_lock);
+        if (id == MEMORY_THREAD::MaxThreads)
+            lock.lock();
+        CACHE& cache = Caches[id];
         assert(obj->IsAllocated());
         obj->ClearAllocated();
-        FreeList.push_back(obj);
-        NumAllocated--;
+        cache.Free.push_back(obj);
+        cache.Stats.Frees++;
+        if ((int) cache.Free.size() >= 2 * BatchSize)
+            Spill(cache);
     }
-    
+
+    // DeleteAll and Reset must not run concurrently with any other use
     void DeleteAll()
     {
+        std::lock_guard<std::mutex> lock(Mutex);
         for (ChunkIterator i_chunk = Chunks.begin(); i_chunk != Chunks.end(); ++i_chunk)
             delete *i_chunk;
         Chunks.clear();
-        FreeList.clear();
-        NumAllocated = 0;
+        ClearCaches();
+    }
+
+    // Free every object at once, keeping the chunks for reuse.
+    // Objects are not destroyed, so must not own anything still in use.
+    void Reset()
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        int used = (NumUsed + ChunkSize - 1) / ChunkSize;
+        ClearCaches();
+        // Unused chunks are released gradually, so that one small
+        // search does not give up the memory the next one needs
+        if (TrimOnReset)
+            ReleaseChunks((Chunks.size() + used + 1) / 2);
+    }
+
+    void SetTrimOnReset(bool trim) { TrimOnReset = trim; }
+
+    // Objects may carry storage of their own after the T, all of it carved
+    // from the same chunks. Must be set before anything is allocated.
+    // Large objects come in smaller chunks and batches, so that the pool
+    // never reserves much more than MaxChunkBytes beyond what is in use.
+    void SetObjectSize(size_t bytes)
+    {
+        assert(bytes >= sizeof(T) && Chunks.empty());
+        ObjectSize = (bytes + alignof(T) - 1) / alignof(T) * alignof(T);
+        ChunkSize = std::max<size_t>(1, std::min<size_t>(MaxChunkSize, MaxChunkBytes / ObjectSize));
+        BatchSize = std::max(1, std::min(MaxBatchSize, ChunkSize / 4));
+    }
+    size_t GetObjectSize() const { return ObjectSize; }
+
+    // Release the chunks whose objects are all free, and return how many.
+    // Like Reset, must not run concurrently with any other use.
+    int Trim()
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        std::vector<MEMORY_OBJECT*> free;
+        for (int i = 0; i <= MEMORY_THREAD::MaxThreads; ++i)
+        {
+            free.insert(free.end(), Caches[i].Free.begin(), Caches[i].Free.end());
+            Caches[i].Free.clear();
+        }
+        for (MEMORY_OBJECT* obj = SharedFree.load(); obj; obj = obj->NextFree)
+            free.push_back(obj);
+        SharedFree.store(0);
+
+        // Objects not yet carved are free too
+        std::vector<int> numFree(Chunks.size());
+        for (int c = 0; c < (int) Chunks.size(); ++c)
+            numFree[c] = ChunkSize - std::min(ChunkSize, std::max(0, NumUsed - c * ChunkSize));
+        std::vector<std::pair<MEMORY_OBJECT*, int> > order;
+        for (int c = 0; c < (int) Chunks.size(); ++c)
+            order.push_back(std::make_pair((MEMORY_OBJECT*) Chunks[c]->Object(0), c));
+        std::sort(order.begin(), order.end());
+        for (int i = 0; i < (int) free.size(); ++i)
+            numFree[ChunkOf(free[i], order)]++;
+
+        // Keep partly used chunks in order, and pass all their free
+        // objects on as if returned by other threads
+        std::vector<CHUNK*> kept;
+        MEMORY_OBJECT* head = 0;
+        for (int i = 0; i < (int) free.size(); ++i)
+        {
+            if (numFree[ChunkOf(free[i], order)] == ChunkSize)
+                continue;
+            free[i]->NextFree = head;
+            head = free[i];
+        }
+        for (int c = 0; c < (int) Chunks.size(); ++c)
+        {
+            if (numFree[c] == ChunkSize)
+            {
+                delete Chunks[c];
+                continue;
+            }
+            for (int i = std::max(0, NumUsed - c * ChunkSize); i < ChunkSize; ++i)
+            {
+                T* obj = Chunks[c]->Object(i);
+                obj->ClearAllocated();
+                obj->NextFree = head;
+                head = obj;
+            }
+            kept.push_back(Chunks[c]);
+        }
+        int released = Chunks.size() - kept.size();
+        Chunks.swap(kept);
+        NumUsed = Chunks.size() * ChunkSize;
+        SharedFree.store(head);
+        return released;
+    }
+
+    // Counts and bytes cover the objects themselves, not any memory they own.
+    // The peak is of objects taken from the chunks, which also includes
+    // up to two batches held free in each thread's cache.
+    int GetNumAllocated() const
+    {
+        long long live = -NumReset;
+        for (int i = 0; i <= MEMORY_THREAD::MaxThreads; ++i)
+            live += Caches[i].Stats.Allocations - Caches[i].Stats.Frees;
+        return live;
+    }
+    int GetPeakAllocated() const { return PeakUsed; }
+    int GetNumReserved() const { return Chunks.size() * ChunkSize; }
+    int GetPeakReserved() const { return PeakChunks * ChunkSize; }
+    size_t GetBytesAllocated() const { return GetNumAllocated() * ObjectSize; }
+    size_t GetPeakBytesAllocated() const { return PeakUsed * ObjectSize; }
+    size_t GetBytesReserved() const { return Chunks.size() * ChunkSize * ObjectSize; }
+    size_t GetPeakBytesReserved() const { return PeakChunks * ChunkSize * ObjectSize; }
+    void ClearPeak() { PeakUsed = NumUsed; PeakChunks = Chunks.size(); }
+
+    // Statistics of the thread with the given MEMORY_THREAD::Id
+    const MEMORY_STATISTICS& GetThreadStatistics(int thread) const { return Caches[thread].Stats; }
+
+    void DisplayStatistics(std::ostream& ostr) const
+    {
+        ostr << "Objects: " << GetNumAllocated() << " live, " << PeakUsed << " peak, "
+            << GetNumReserved() << " reserved (" << GetBytesReserved() << " bytes, peak "
+            << GetPeakBytesReserved() << ")" << std::endl;
+        for (int i = 0; i <= MEMORY_THREAD::MaxThreads; ++i)
+        {
+            const MEMORY_STATISTICS& stats = Caches[i].Stats;
+            if (stats.Allocations == 0 && stats.Frees == 0)
+                continue;
+            ostr << "Thread " << i << ": " << stats.Allocations << " allocations, "
+                << stats.Frees << " frees, " << stats.Refills << " refills, "
+                << stats.Carves << " carves, " << stats.Spills << " spills" << std::endl;
+        }
     }
-    
-    int GetNumAllocated() const { return NumAllocated; }
 
 private:
 
+    static const int MaxChunkSize = 256;
+    static const int MaxBatchSize = 64;
+    static const size_t MaxChunkBytes = 1 << 20;
+
+    // Objects are constructed when their chunk is, and destroyed with it.
+    // The storage after each T starts zeroed.
     struct CHUNK
     {
-        static const int Size = 256;
-        T Objects[Size];
+        CHUNK(size_t objectSize, int size)
+        :   ObjectSize(objectSize),
+            Size(size),
+            Memory(static_cast<char*>(::operator new(size * objectSize)))
+        {
+            std::memset(Memory, 0, size * objectSize);
+            for (int i = 0; i < Size; ++i)
+                new (Object(i)) T();
+        }
+
+        ~CHUNK()
+        {
+            for (int i = 0; i < Size; ++i)
+                Object(i)->~T();
+            ::operator delete(Memory);
+        }
+
+        T* Object(int i) const { return reinterpret_cast<T*>(Memory + i * ObjectSize); }
+
+        size_t ObjectSize;
+        int Size;
+        char* Memory;
     };
 
-    void NewChunk()
+    struct CACHE
     {
-        CHUNK* chunk = new CHUNK;
-        Chunks.push_back(chunk);
-        for (int i = CHUNK::Size - 1; i >= 0; --i)
+        std::vector<T*> Free;
+        MEMORY_STATISTICS Stats;
+    };
+
+    void Refill(CACHE& cache)
+    {
+        // Taking the whole shared list at once avoids ABA on the pop
+        MEMORY_OBJECT* head = SharedFree.exchange(0, std::memory_order_acquire);
+        if (head)
+        {
+            for (; head; head = head->NextFree)
+                cache.Free.push_back(static_cast<T*>(head));
+            cache.Stats.Refills++;
+            return;
+        }
+
+        // Objects never freed since the last Reset are handed out in order
+        std::lock_guard<std::mutex> lock(Mutex);
+        for (int i = 0; i < BatchSize; ++i)
+        {
+            if (NumUsed == (int) Chunks.size() * ChunkSize)
+                NewChunk();
+            T* obj = Chunks[NumUsed / ChunkSize]->Object(NumUsed % ChunkSize);
+            obj->ClearAllocated();
+            cache.Free.push_back(obj);
+            NumUsed++;
+        }
+        PeakUsed = std::max(PeakUsed, NumUsed);
+        std::reverse(cache.Free.end() - BatchSize, cache.Free.end());
+        cache.Stats.Carves++;
+    }
+
+    void Spill(CACHE& cache)
+    {
+        // Keep the most recently freed objects, which are more likely cached
+        MEMORY_OBJECT* head = 0;
+        MEMORY_OBJECT* tail = cache.Free[0];
+        for (int i = 0; i < BatchSize; ++i)
         {
-            FreeList.push_back(&chunk->Objects[i]);
-            chunk->Objects[i].ClearAllocated();
+            cache.Free[i]->NextFree = head;
+            head = cache.Free[i];
         }
+        cache.Free.erase(cache.Free.begin(), cache.Free.begin() + BatchSize);
+
+        tail->NextFree = SharedFree.load(std::memory_order_relaxed);
+        while (!SharedFree.compare_exchange_weak(tail->NextFree, head,
+            std::memory_order_release, std::memory_order_relaxed));
+        cache.Stats.Spills++;
+    }
+
+    void ClearCaches()
+    {
+        NumReset = 0;
+        for (int i = 0; i <= MEMORY_THREAD::MaxThreads; ++i)
+        {
+            Caches[i].Free.clear();
+            NumReset += Caches[i].Stats.Allocations - Caches[i].Stats.Frees;
+        }
+        SharedFree.store(0, std::memory_order_relaxed);
+        NumUsed = 0;
+    }
+
+    static int ChunkOf(const MEMORY_OBJECT* obj, const std::vector<std::pair<MEMORY_OBJECT*, int> >& order)
+    {
+        // Chunks sorted by address, so obj is in the last one starting at or before it
+        int i = std::upper_bound(order.begin(), order.end(), 
+            std::make_pair((MEMORY_OBJECT*) obj, (int) order.size())) - order.begin() - 1;
+        return order[i].second;
     }
 
+    void ReleaseChunks(int keep)
+    {
+        while ((int) Chunks.size() > keep)
+        {
+            delete Chunks.back();
+            Chunks.pop_back();
+        }
+    }
+
+    void NewChunk()
+    {
+        CHUNK* chunk = new CHUNK(ObjectSize, ChunkSize);
+        Chunks.push_back(chunk);
+        PeakChunks = std::max(PeakChunks, (int) Chunks.size());
+        for (int i = 0; i < ChunkSize; ++i)
+            chunk->Object(i)->ClearAllocated();
+    }
+
+    size_t ObjectSize;
+    int ChunkSize, BatchSize; // objects per chunk, and per batch moved between caches
     std::vector<CHUNK*> Chunks;
-    std::vector<T*> FreeList;
-    int NumAllocated;
+    int NumUsed; // objects handed out from the chunks since the last Reset
+    int PeakUsed, PeakChunks;
+    long long NumReset; // objects released by Reset or DeleteAll rather than Free
+    bool TrimOnReset;
+    CACHE Caches[MEMORY_THREAD::MaxThreads + 1];
+    std::atomic<MEMORY_OBJECT*> SharedFree;
+    std::mutex Mutex; // guards the chunks
+    std::mutex OverflowMutex; // guards the cache shared by threads beyond MaxThreads
     typedef typename std::vector<CHUNK*>::iterator ChunkIterator;
 };
 
+// Defined for std::min, which takes it by reference
+template <class T>
+const int MEMORY_POOL<T>::MaxBatchSize;
+
 #endif // MEMORY_POOL_H
@@ -82,6 +82,12 @@ void NETWORK::FreeState(STATE* state) const
     MemoryPool.Free(nstate);
 }
 
+void NETWORK::TrimMemory() const
+{
+    MemoryPool.Trim();
+    SIMULATOR::TrimMemory();
+}
+
 bool NETWORK::Step(STATE& state, int action, 
     int& observation, double& reward, STATUS& status) const
 {
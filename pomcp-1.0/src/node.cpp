@@ -6,102 +6,242 @@ using namespace std;
 
 //-----------------------------------------------------------------------------
 
-int QNODE::NumChildren = 0;
+// Each of the arrays after a VNODE must start suitably aligned
+static_assert(sizeof(VNODE) % alignof(VALUE<int>) == 0
+    && sizeof(VALUE<int>) % alignof(VALUE<double>) == 0
+    && sizeof(VALUE<double>) % alignof(QNODE) == 0
+    && sizeof(QNODE) % alignof(VNODE*) == 0, "VNODE storage misaligned");
 
-int QNODE::NumOtherAgentValues = 0;
+//-----------------------------------------------------------------------------
+
+// Defined for std::min, which takes it by reference
+const int QNODE::MaxBuckets;
 
-void QNODE::Initialise()
+void QNODE::Initialise(int action, int numActions, int numBuckets, int numOtherAgentValues)
 {
-    assert(NumChildren);
-    Children.resize(NumChildren);
-    for (int observation = 0; observation < QNODE::NumChildren; observation++)
-        Children[observation] = 0;
-    AlphaData.AlphaSum.clear();
-    assert(NumOtherAgentValues);
-    OtherAgentValues.resize(NumOtherAgentValues);
-    for (int i = 0; i < QNODE::NumOtherAgentValues; i++)
+    assert(numOtherAgentValues <= MaxOtherAgentValues);
+    assert(numBuckets > 0 && numBuckets <= MaxBuckets);
+    delete AlphaData;
+    AlphaData = 0;
+    Action = action;
+    NumActions = numActions;
+    NumBuckets = numBuckets;
+    for (int b = 0; b < numBuckets; b++)
+        Buckets()[b] = 0;
+    NumOtherAgentValues = numOtherAgentValues;
+    for (int i = 0; i < numOtherAgentValues; i++)
 	OtherAgentValues[i].Set(0, 0);
 }
 
+ALPHA& QNODE::Alpha()
+{
+    if (!AlphaData)
+        AlphaData = new ALPHA;
+    return *AlphaData;
+}
+
+const ALPHA& QNODE::Alpha() const
+{
+    static const ALPHA empty = ALPHA();
+    return AlphaData ? *AlphaData : empty;
+}
+
 void QNODE::DisplayValue(HISTORY& history, int maxDepth, ostream& ostr) const
 {
     history.Display(ostr);
-    ostr << ": " << Value.GetValue() << " (" << Value.GetCount() << ")\n";
+    ostr << ": " << Value().GetValue() << " (" << Value().GetCount() << ")\n";
     if (history.Size() >= maxDepth)
         return;
 
-    for (int observation = 0; observation < NumChildren; observation++)
+    for (VNODE* child = FirstChild(); child; child = NextChild(child))
     {
-        if (Children[observation])
-        {
-            history.Back().Observation = observation;
-            Children[observation]->DisplayValue(history, maxDepth, ostr);
-        }
+        history.Back().Observation = child->Observation;
+        child->DisplayValue(history, maxDepth, ostr);
     }
 }
 
 void QNODE::DisplayPolicy(HISTORY& history, int maxDepth, ostream& ostr) const
 {
     history.Display(ostr);
-    ostr << ": " << Value.GetValue() << " (" << Value.GetCount() << ")\n";
+    ostr << ": " << Value().GetValue() << " (" << Value().GetCount() << ")\n";
     if (history.Size() >= maxDepth)
         return;
 
-    for (int observation = 0; observation < NumChildren; observation++)
+    for (VNODE* child = FirstChild(); child; child = NextChild(child))
+    {
+        history.Back().Observation = child->Observation;
+        child->DisplayPolicy(history, maxDepth, ostr);
+    }
+}
+
+VNODE* QNODE::Child(int c) const
+{
+    VNODE** bucket = &Buckets()[Bucket(c)];
+    for (VNODE* child = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); child; child = child->Sibling)
+        if (child->Observation == c)
+            return child;
+    return 0;
+}
+
+VNODE* QNODE::FirstChild(int b) const
+{
+    for (; b < NumBuckets; b++)
+        if (Buckets()[b])
+            return Buckets()[b];
+    return 0;
+}
+
+VNODE* QNODE::NextChild(const VNODE* child) const
+{
+    return child->Sibling ? child->Sibling : FirstChild(Bucket(child->Observation) + 1);
+}
+
+VNODE* QNODE::AddChild(int c, VNODE* vnode, bool atomic)
+{
+    VNODE** bucket = &Buckets()[Bucket(c)];
+    vnode->Observation = c;
+    if (!atomic)
+    {
+        vnode->Sibling = *bucket;
+        *bucket = vnode;
+        return vnode;
+    }
+
+    // Publish vnode at the head of the bucket, unless c turns up among
+    // the children added by other threads while we were trying
+    VNODE* head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    VNODE* checked = 0;
+    while (true)
+    {
+        for (VNODE* child = head; child != checked; child = child->Sibling)
+            if (child->Observation == c)
+                return child;
+        checked = head;
+        vnode->Sibling = head;
+        if (__atomic_compare_exchange_n(bucket, &head, vnode, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return vnode;
+    }
+}
+
+VNODE* QNODE::RemoveChild(int c)
+{
+    for (VNODE** link = &Buckets()[Bucket(c)]; *link; link = &(*link)->Sibling)
     {
-        if (Children[observation])
+        VNODE* child = *link;
+        if (child->Observation == c)
         {
-            history.Back().Observation = observation;
-            Children[observation]->DisplayPolicy(history, maxDepth, ostr);
+            *link = child->Sibling;
+            child->Sibling = 0;
+            return child;
         }
     }
+    return 0;
 }
 
 //-----------------------------------------------------------------------------
 
-MEMORY_POOL<VNODE> VNODE::VNodePool;
-
-int VNODE::NumChildren = 0;
+VNODE::~VNODE()
+{
+    for (int action = 0; action < NumActions; action++)
+        delete Children()[action].AlphaData;
+}
 
-void VNODE::Initialise()
+void VNODE::Initialise(int numActions, int numBuckets, int numOtherAgentValues)
 {
-    assert(NumChildren);
-    Children.resize(VNODE::NumChildren);
-    for (int action = 0; action < VNODE::NumChildren; action++)
-        Children[action].Initialise();
+    assert(numActions);
+    // A pool object is only ever used for nodes of one size
+    assert(NumActions == 0 || NumActions == numActions);
+    NumActions = numActions;
+    for (int action = 0; action < numActions; action++)
+    {
+        ActionValues()[action].Set(0, 0);
+        ActionAMAFs()[action].Set(0, 0);
+        Children()[action].Initialise(action, numActions, numBuckets, numOtherAgentValues);
+    }
+    Observation = -1;
+    Sibling = 0;
 }
 
-VNODE* VNODE::Create()
+VNODE* VNODE::Create(MEMORY_POOL<VNODE>& pool, int numActions, int numBuckets,
+    int numOtherAgentValues)
 {
-    VNODE* vnode = VNodePool.Allocate();
-    vnode->Initialise();
+    assert(pool.GetObjectSize() >= GetBytes(numActions, numBuckets));
+    VNODE* vnode = pool.Allocate();
+    vnode->Initialise(numActions, numBuckets, numOtherAgentValues);
     return vnode;
 }
 
-void VNODE::Free(VNODE* vnode, const SIMULATOR& simulator)
+size_t VNODE::GetBytes(int numActions, int numBuckets)
+{
+    return sizeof(VNODE) + numActions * (sizeof(VALUE<int>) + sizeof(VALUE<double>)
+        + sizeof(QNODE) + numBuckets * sizeof(VNODE*));
+}
+
+void VNODE::Free(VNODE* vnode, const SIMULATOR& simulator, MEMORY_POOL<VNODE>& pool)
 {
-    //std::cout << "before free\n";
     vnode->BeliefState.Free(simulator);
-    VNodePool.Free(vnode);
-    //std::cout << "after free\n";
-    for (int action = 0; action < VNODE::NumChildren; action++)
-        for (int observation = 0; observation < QNODE::NumChildren; observation++)
-            if (vnode->Child(action).Child(observation))
-                Free(vnode->Child(action).Child(observation), simulator);
+    for (int action = 0; action < vnode->GetNumChildren(); action++)
+    {
+        const QNODE& qnode = vnode->Child(action);
+        VNODE* child = qnode.FirstChild();
+        while (child)
+        {
+            VNODE* next = qnode.NextChild(child);
+            Free(child, simulator, pool);
+            child = next;
+        }
+    }
+    pool.Free(vnode);
 }
 
-void VNODE::FreeAll()
+void VNODE::FreeBeliefs(VNODE* vnode, const SIMULATOR& simulator, int maxDepth)
 {
-	VNodePool.DeleteAll();
+    vnode->BeliefState.Free(simulator);
+    if (maxDepth == 0)
+        return;
+    for (int action = 0; action < vnode->GetNumChildren(); action++)
+    {
+        const QNODE& qnode = vnode->Child(action);
+        for (VNODE* child = qnode.FirstChild(); child; child = qnode.NextChild(child))
+            FreeBeliefs(child, simulator, maxDepth - 1);
+    }
 }
 
 void VNODE::SetChildren(int count, double value)
 {
-    for (int action = 0; action < NumChildren; action++)
+    for (int action = 0; action < GetNumChildren(); action++)
+    {
+        ActionValue(action).Set(count, value);
+        ActionAMAF(action).Set(count, value);
+    }
+}
+
+void VNODE::CopyValues(const VNODE& vnode)
+{
+    Value = vnode.Value;
+    for (int action = 0; action < GetNumChildren(); action++)
+    {
+        ActionValue(action) = vnode.ActionValue(action);
+        ActionAMAF(action) = vnode.ActionAMAF(action);
+        QNODE& qnode = Child(action);
+        for (int i = 0; i < qnode.GetNumOtherAgentValues(); i++)
+            qnode.OtherAgentValues[i] = vnode.Child(action).OtherAgentValues[i];
+    }
+}
+
+void VNODE::MergeValues(const VNODE& vnode, const VNODE& base)
+{
+    Value.Merge(vnode.Value, base.Value);
+    for (int action = 0; action < GetNumChildren(); action++)
     {
-        QNODE& qnode = Children[action];
-        qnode.Value.Set(count, value);
-        qnode.AMAF.Set(count, value);
+        QNODE& qnode = Child(action);
+        const QNODE& other = vnode.Child(action);
+        const QNODE& baseq = base.Child(action);
+        ActionValue(action).Merge(vnode.ActionValue(action), base.ActionValue(action));
+        ActionAMAF(action).Merge(vnode.ActionAMAF(action), base.ActionAMAF(action));
+        for (int i = 0; i < qnode.GetNumOtherAgentValues(); i++)
+            qnode.OtherAgentValues[i].Merge(other.OtherAgentValues[i], baseq.OtherAgentValues[i]);
     }
 }
 
@@ -110,10 +250,10 @@ void VNODE::DisplayValue(HISTORY& history, int maxDepth, ostream& ostr) const
     if (history.Size() >= maxDepth)
         return;
 
-    for (int action = 0; action < NumChildren; action++)
+    for (int action = 0; action < GetNumChildren(); action++)
     {
         history.Add(action);
-        Children[action].DisplayValue(history, maxDepth, ostr);
+        Child(action).DisplayValue(history, maxDepth, ostr);
         history.Pop();
     }
 }
@@ -125,19 +265,19 @@ void VNODE::DisplayPolicy(HISTORY& history, int maxDepth, ostream& ostr) const
 
     double bestq = -Infinity;
     int besta = -1;
-    for (int action = 0; action < NumChildren; action++)
+    for (int action = 0; action < GetNumChildren(); action++)
     {
-        if (Children[action].Value.GetValue() > bestq)
+        if (ActionValue(action).GetValue() > bestq)
         {
             besta = action;
-            bestq = Children[action].Value.GetValue();
+            bestq = ActionValue(action).GetValue();
         }
     }
 
     if (besta != -1)
     {
         history.Add(besta);
-        Children[besta].DisplayPolicy(history, maxDepth, ostr);
+        Child(besta).DisplayPolicy(history, maxDepth, ostr);
         history.Pop();
     }
 }
@@ -50,18 +50,77 @@ public:
         Total += totalReward * weight;
     }
 
+    // Accumulate statistics gathered by another search
+    void Merge(const VALUE& value)
+    {
+        Count += value.Count;
+        Total += value.Total;
+    }
+
+    // Accumulate only the statistics gathered since value was copied from base
+    void Merge(const VALUE& value, const VALUE& base)
+    {
+        Count += value.Count - base.Count;
+        Total += value.Total - base.Total;
+    }
+
+    // Lock-free Add and Subtract, for search threads sharing one tree.
+    // Count and Total are updated and read separately, so a concurrent
+    // reader may see one without the other, which UCB selection tolerates.
+    void AtomicAdd(double totalReward, COUNT weight = 1)
+    {
+        AtomicIncrement(Count, weight);
+        AtomicIncrement(Total, totalReward * weight);
+    }
+
+    void AtomicSubtract(double totalReward)
+    {
+        AtomicIncrement(Count, (COUNT) -1);
+        AtomicIncrement(Total, -totalReward);
+    }
+
     double GetValue() const
     {
-        return Count == 0 ? Total : Total / Count;
+        COUNT count = AtomicLoad(Count);
+        double total = AtomicLoad(Total);
+        return count == 0 ? total : total / count;
     }
 
     COUNT GetCount() const
     {
-        return Count;
+        return AtomicLoad(Count);
     }
 
 private:
 
+    // Relaxed loads are plain loads on x86, so unshared trees pay nothing
+    static int AtomicLoad(const int& x)
+    {
+        return __atomic_load_n(&x, __ATOMIC_RELAXED);
+    }
+
+    static double AtomicLoad(const double& x)
+    {
+        double result;
+        __atomic_load(&x, &result, __ATOMIC_RELAXED);
+        return result;
+    }
+
+    static void AtomicIncrement(int& x, int delta)
+    {
+        __atomic_fetch_add(&x, delta, __ATOMIC_RELAXED);
+    }
+
+    static void AtomicIncrement(double& x, double delta)
+    {
+        double expected, desired;
+        __atomic_load(&x, &expected, __ATOMIC_RELAXED);
+        do
+            desired = expected + delta;
+        while (!__atomic_compare_exchange(&x, &expected, &desired, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
     COUNT Count;
     double Total;
 };
@@ -72,29 +131,63 @@ class QNODE
 {
 public:
 
-    VALUE<int> Value;
-    VALUE<double> AMAF;
+    // Value statistics live in the parent VNODE's per-action arrays,
+    // found from this QNODE's action
+    VALUE<int>& Value() { return Values()[Action]; }
+    const VALUE<int>& Value() const { return Values()[Action]; }
+    VALUE<double>& AMAF() { return AMAFs()[Action]; }
+    const VALUE<double>& AMAF() const { return AMAFs()[Action]; }
     
-    std::vector<VALUE<int> > OtherAgentValues;
-
-    void Initialise();
-
-    VNODE*& Child(int c) { return Children[c]; }
-    VNODE* Child(int c) const { return Children[c]; }
-    ALPHA& Alpha() { return AlphaData; }
-    const ALPHA& Alpha() const { return AlphaData; }
+    // Only reward adaptive agents keep a value for the other agent
+    static const int MaxOtherAgentValues = 1;
+    VALUE<int> OtherAgentValues[MaxOtherAgentValues];
+    int GetNumOtherAgentValues() const { return NumOtherAgentValues; }
+
+    // Expansion only sets the value statistics, children and alpha
+    // vectors are created on first use
+    void Initialise(int action, int numActions, int numBuckets, int numOtherAgentValues);
+
+    // Children are kept sparse, in a hash table of the observations seen so
+    // far, whose buckets are lists threaded through the children. Trees with
+    // up to MaxBuckets observations get a bucket for each observation, as
+    // long as a node has no more than MaxNodeBuckets over all its actions.
+    // AddChild returns the child for observation c, which is not vnode if
+    // another thread added one first when atomic is set.
+    static const int MaxBuckets = 16;
+    static const int MaxNodeBuckets = 256;
+    VNODE* Child(int c) const;
+    VNODE* FirstChild() const { return FirstChild(0); }
+    VNODE* NextChild(const VNODE* child) const;
+    VNODE* AddChild(int c, VNODE* vnode, bool atomic = false);
+    VNODE* RemoveChild(int c);
+    ALPHA& Alpha();
+    const ALPHA& Alpha() const;
 
     void DisplayValue(HISTORY& history, int maxDepth, std::ostream& ostr) const;
     void DisplayPolicy(HISTORY& history, int maxDepth, std::ostream& ostr) const;
 
-    static int NumChildren;
-    
-    static int NumOtherAgentValues;
-
 private:
 
-    std::vector<VNODE*> Children;
-    ALPHA AlphaData;
+    // The parent's QNODEs directly follow its AMAF array, which directly
+    // follows its value array
+    VALUE<double>* AMAFs() const
+    {
+        return reinterpret_cast<VALUE<double>*>(const_cast<QNODE*>(this - Action)) - NumActions;
+    }
+    VALUE<int>* Values() const { return reinterpret_cast<VALUE<int>*>(AMAFs()) - NumActions; }
+    // and are followed by the buckets of each QNODE in turn
+    VNODE** Buckets() const
+    {
+        return reinterpret_cast<VNODE**>(const_cast<QNODE*>(this - Action + NumActions))
+            + Action * NumBuckets;
+    }
+    int Bucket(int c) const { return c % NumBuckets; }
+    // First child in bucket b or any later one
+    VNODE* FirstChild(int b) const;
+
+    ALPHA* AlphaData; // owned, kept with the node's memory until it is reused
+    int NumOtherAgentValues;
+    int Action, NumActions, NumBuckets;
 
 friend class VNODE;
 };
@@ -107,28 +200,58 @@ public:
 
     VALUE<int> Value;
 
-    void Initialise();
-    static VNODE* Create();
-    static void Free(VNODE* vnode, const SIMULATOR& simulator);
-    static void FreeAll();
-
-    QNODE& Child(int c) { return Children[c]; }
-    const QNODE& Child(int c) const { return Children[c]; }
+    // Node sizes are per tree, and nodes come from the tree's own pool,
+    // whose object size must be GetBytes(numActions, numBuckets). The
+    // per-action values, QNODEs and child buckets are stored in the pool
+    // object, after the VNODE.
+    ~VNODE();
+    void Initialise(int numActions, int numBuckets, int numOtherAgentValues);
+    static VNODE* Create(MEMORY_POOL<VNODE>& pool, int numActions, int numBuckets,
+        int numOtherAgentValues);
+    // Memory held by a node, not counting its particles or alpha vectors
+    static size_t GetBytes(int numActions, int numBuckets);
+    static void Free(VNODE* vnode, const SIMULATOR& simulator, MEMORY_POOL<VNODE>& pool);
+    // Frees only the particles, before the whole pool is Reset. Nodes more
+    // than maxDepth below vnode are not visited, unless maxDepth is negative.
+    static void FreeBeliefs(VNODE* vnode, const SIMULATOR& simulator, int maxDepth = -1);
+
+    QNODE& Child(int c) { return Children()[c]; }
+    const QNODE& Child(int c) const { return Children()[c]; }
+    // Per-action values are contiguous, so that GreedyUCB streams through them
+    VALUE<int>& ActionValue(int a) { return ActionValues()[a]; }
+    const VALUE<int>& ActionValue(int a) const { return ActionValues()[a]; }
+    VALUE<double>& ActionAMAF(int a) { return ActionAMAFs()[a]; }
+    const VALUE<double>& ActionAMAF(int a) const { return ActionAMAFs()[a]; }
+    int GetNumChildren() const { return NumActions; }
+    int GetObservation() const { return Observation; }
     BELIEF_STATE& Beliefs() { return BeliefState; }
     const BELIEF_STATE& Beliefs() const { return BeliefState; }
 
     void SetChildren(int count, double value);
+    void CopyValues(const VNODE& vnode);
+    void MergeValues(const VNODE& vnode, const VNODE& base);
 
     void DisplayValue(HISTORY& history, int maxDepth, std::ostream& ostr) const;
     void DisplayPolicy(HISTORY& history, int maxDepth, std::ostream& ostr) const;
 
-    static int NumChildren;
-
 private:
 
-    std::vector<QNODE> Children;
+    VALUE<int>* ActionValues() const
+    {
+        return reinterpret_cast<VALUE<int>*>(const_cast<VNODE*>(this + 1));
+    }
+    VALUE<double>* ActionAMAFs() const
+    {
+        return reinterpret_cast<VALUE<double>*>(ActionValues() + NumActions);
+    }
+    QNODE* Children() const { return reinterpret_cast<QNODE*>(ActionAMAFs() + NumActions); }
+
     BELIEF_STATE BeliefState;
-    static MEMORY_POOL<VNODE> VNodePool;
+    int Observation;
+    int NumActions;
+    VNODE* Sibling;
+
+friend class QNODE;
 };
 
 #endif // NODE_H
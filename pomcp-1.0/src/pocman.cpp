@@ -158,6 +158,12 @@ void POCMAN::FreeState(STATE* state) const
     MemoryPool.Free(pocstate);
 }
 
+void POCMAN::TrimMemory() const
+{
+    MemoryPool.Trim();
+    SIMULATOR::TrimMemory();
+}
+
 void POCMAN::FreeReward(REWARD_TEMPLATE* reward) const
 {
     
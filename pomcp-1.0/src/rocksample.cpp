@@ -142,6 +142,12 @@ void ROCKSAMPLE::FreeState(STATE* state) const
     MemoryPool.Free(rockstate);
 }
 
+void ROCKSAMPLE::TrimMemory() const
+{
+    MemoryPool.Trim();
+    SIMULATOR::TrimMemory();
+}
+
 bool ROCKSAMPLE::Step(STATE& state, int action,
     int& observation, double& reward, STATUS& status) const
 {
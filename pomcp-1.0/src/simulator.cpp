@@ -62,6 +62,11 @@ void SIMULATOR::FreeReward(REWARD_TEMPLATE* reward) const
     RewardMemoryPool.Free(reward);
 }
 
+void SIMULATOR::TrimMemory() const
+{
+    RewardMemoryPool.Trim();
+}
+
 REWARD_TEMPLATE* SIMULATOR::Copy(const REWARD_TEMPLATE& reward) const
 {
     REWARD_TEMPLATE* newtemplate = RewardMemoryPool.Allocate();
@@ -126,7 +131,7 @@ bool SIMULATOR::IsActionMultiagent(const int& action, const HISTORY& history) co
 int SIMULATOR::SelectRandom(const STATE& state, const HISTORY& history,
     const STATUS& status, const int& index) const
 {
-    static vector<int> actions;
+    static thread_local vector<int> actions;
 
     if (Knowledge.RolloutLevel >= KNOWLEDGE::SMART || status.HumanDefined)
     {
@@ -157,7 +162,7 @@ int SIMULATOR::SelectRandom(const STATE& state, const HISTORY& history,
 void SIMULATOR::Prior(const STATE* state, const HISTORY& history,
     VNODE* vnode, const STATUS& status, const int& index) const
 {
-    static vector<int> actions;
+    static thread_local vector<int> actions;
     
     int legalActionSize = -1;
     
@@ -185,10 +190,10 @@ void SIMULATOR::Prior(const STATE* state, const HISTORY& history,
         {
             int a = *i_action;
             QNODE& qnode = vnode->Child(a);
-            qnode.Value.Set(0, 0);
-            qnode.AMAF.Set(0, 0);
+            qnode.Value().Set(0, 0);
+            qnode.AMAF().Set(0, 0);
 	    if (IsActionMultiagent(a, history))
-		for (int i = 0; i < (int) qnode.OtherAgentValues.size(); i++)
+		for (int i = 0; i < qnode.GetNumOtherAgentValues(); i++)
 		    qnode.OtherAgentValues[i].Set(status.MultiAgentPriorCount, status.MultiAgentPriorValue);
         }
     }
@@ -208,12 +213,12 @@ void SIMULATOR::Prior(const STATE* state, const HISTORY& history,
 	    {
 		int a = *i_action;
 		QNODE& qnode = vnode->Child(a);
-		qnode.Value.Set(status.SmartTreeCount, Knowledge.SmartTreeValue);
-		qnode.AMAF.Set(status.SmartTreeCount, Knowledge.SmartTreeValue);
+		qnode.Value().Set(status.SmartTreeCount, Knowledge.SmartTreeValue);
+		qnode.AMAF().Set(status.SmartTreeCount, Knowledge.SmartTreeValue);
 		if (IsActionMultiagent(a, history))
-		    for (int i = 0; i < (int) qnode.OtherAgentValues.size(); i++)
+		    for (int i = 0; i < qnode.GetNumOtherAgentValues(); i++)
 			qnode.OtherAgentValues[i].Set(status.MultiAgentPriorCount, status.MultiAgentPriorValue);
-		//for (int i = 0; i < (int) qnode.OtherAgentValues.size(); i++)
+		//for (int i = 0; i < qnode.GetNumOtherAgentValues(); i++)
 		    //qnode.OtherAgentValues[i].Set(Knowledge.SmartTreeCount, Knowledge.SmartTreeValue);
 	    }    
     }
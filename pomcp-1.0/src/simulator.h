@@ -131,6 +131,9 @@ public:
     // Free memory for state
     virtual void FreeState(STATE* state) const = 0;
 
+    // Release pooled memory that is no longer in use, e.g. between runs
+    virtual void TrimMemory() const;
+
     // Update state according to action, and get observation and reward. 
     // Return value of true indicates termination of episode (if episodic)
     virtual bool Step(STATE& state, int action, 
@@ -2,6 +2,9 @@
 #define STATISTIC_H
 
 #include <math.h>
+#include <iostream>
+#include <vector>
+#include <algorithm>
 
 //----------------------------------------------------------------------------
 
@@ -10,12 +13,14 @@ class STATISTIC
 public:
 
     STATISTIC();
-    STATISTIC(double val, int count);
+    STATISTIC(double val, long long count);
 
     void Add(double val);
+    // Combines with statistics gathered separately, as if added here
+    void Merge(const STATISTIC& stat);
     void Clear();
-    int GetCount() const;
-    void Initialise(double val, int count);
+    long long GetCount() const;
+    void Initialise(double val, long long count);
     double GetTotal() const;
     double GetMean() const;
     double GetVariance() const;
@@ -24,12 +29,15 @@ public:
     double GetMax() const;
     double GetMin() const;
     void Print(const std::string& name, std::ostream& ostr) const;
+    // Binary form, for merging statistics gathered by other processes
+    void Write(std::ostream& ostr) const;
+    void Read(std::istream& istr);
 
 private:
 
-    int Count;
+    long long Count;
     double Mean;
-    double Variance;
+    double SumSquares; // of differences from the mean, as in Welford's method
     double Min, Max;
 };
 
@@ -38,44 +46,61 @@ inline STATISTIC::STATISTIC()
     Clear();
 }
 
-inline STATISTIC::STATISTIC(double val, int count)
+inline STATISTIC::STATISTIC(double val, long long count)
 {
     Initialise(val, count);
 }
 
 inline void STATISTIC::Add(double val)
 {
-    double meanOld = Mean;
-    int countOld = Count;
     ++Count;
     assert(Count > 0); // overflow
-    Mean += (val - Mean) / Count;
-    Variance = (countOld * (Variance + meanOld * meanOld)
-                  + val * val) / Count - Mean * Mean;
+    double delta = val - Mean;
+    Mean += delta / Count;
+    SumSquares += delta * (val - Mean);
     if (val > Max)
         Max = val;
     if (val < Min)
         Min = val;
 }
 
+inline void STATISTIC::Merge(const STATISTIC& stat)
+{
+    if (stat.Count == 0)
+        return;
+    // Chan et al.'s pairwise update
+    long long count = Count + stat.Count;
+    assert(count > 0); // overflow
+    double delta = stat.Mean - Mean;
+    double weight = (double) stat.Count / count;
+    SumSquares += stat.SumSquares + delta * delta * Count * weight;
+    Mean += delta * weight;
+    Count = count;
+    if (stat.Max > Max)
+        Max = stat.Max;
+    if (stat.Min < Min)
+        Min = stat.Min;
+}
+
 inline void STATISTIC::Clear()
 {
     Count = 0;
     Mean = 0;
-    Variance = 0;
+    SumSquares = 0;
     Min = +Infinity;
     Max = -Infinity;
 }
 
-inline int STATISTIC::GetCount() const
+inline long long STATISTIC::GetCount() const
 {
     return Count;
 }
 
-inline void STATISTIC::Initialise(double val, int count)
+inline void STATISTIC::Initialise(double val, long long count)
 {
     Count = count;
     Mean = val;
+    SumSquares = 0;
 }
 
 inline double STATISTIC::GetTotal() const
@@ -88,14 +113,19 @@ inline double STATISTIC::GetMean() const
     return Mean;
 }
 
+inline double STATISTIC::GetVariance() const
+{
+    return Count == 0 ? 0 : SumSquares / Count;
+}
+
 inline double STATISTIC::GetStdDev() const
 {
-    return sqrt(Variance);
+    return sqrt(GetVariance());
 }
 
 inline double STATISTIC::GetStdErr() const
 {
-    return sqrt(Variance / Count);
+    return sqrt(GetVariance() / Count);
 }
 
 inline double STATISTIC::GetMax() const
@@ -113,6 +143,130 @@ inline void STATISTIC::Print(const std::string& name, std::ostream& ostr) const
     ostr << name << ": " << Mean << " [" << Min << ", " << Max << "]" << std::endl;
 }
 
+inline void STATISTIC::Write(std::ostream& ostr) const
+{
+    ostr.write((const char*) &Count, sizeof(Count));
+    ostr.write((const char*) &Mean, sizeof(Mean));
+    ostr.write((const char*) &SumSquares, sizeof(SumSquares));
+    ostr.write((const char*) &Min, sizeof(Min));
+    ostr.write((const char*) &Max, sizeof(Max));
+}
+
+inline void STATISTIC::Read(std::istream& istr)
+{
+    istr.read((char*) &Count, sizeof(Count));
+    istr.read((char*) &Mean, sizeof(Mean));
+    istr.read((char*) &SumSquares, sizeof(SumSquares));
+    istr.read((char*) &Min, sizeof(Min));
+    istr.read((char*) &Max, sizeof(Max));
+}
+
+//----------------------------------------------------------------------------
+// Counts of positive values such as latencies, in buckets spaced evenly on
+// a log scale, eight per doubling from MinValue. Quantiles are the upper
+// edge of their bucket, so they overstate by at most 9%.
+
+class HISTOGRAM
+{
+public:
+
+    HISTOGRAM();
+
+    void Add(double val);
+    void Merge(const HISTOGRAM& histogram);
+    void Clear();
+    long long GetCount() const;
+    double GetQuantile(double q) const;
+    double GetMax() const;
+    void Write(std::ostream& ostr) const;
+    void Read(std::istream& istr);
+
+private:
+
+    static const int BucketsPerDoubling = 8, NumBuckets = 320;
+    static double MinValue() { return 1e-7; }
+    static double UpperEdge(int bucket);
+
+    std::vector<long long> Counts;
+    long long Count;
+    double Max;
+};
+
+inline HISTOGRAM::HISTOGRAM()
+:   Counts(NumBuckets)
+{
+    Clear();
+}
+
+inline void HISTOGRAM::Add(double val)
+{
+    int bucket = 0;
+    if (val >= MinValue())
+        bucket = std::min(NumBuckets - 1,
+            1 + (int) (log2(val / MinValue()) * BucketsPerDoubling));
+    Counts[bucket]++;
+    Count++;
+    if (val > Max)
+        Max = val;
+}
+
+inline void HISTOGRAM::Merge(const HISTOGRAM& histogram)
+{
+    for (int i = 0; i < NumBuckets; i++)
+        Counts[i] += histogram.Counts[i];
+    Count += histogram.Count;
+    if (histogram.Max > Max)
+        Max = histogram.Max;
+}
+
+inline void HISTOGRAM::Clear()
+{
+    std::fill(Counts.begin(), Counts.end(), 0);
+    Count = 0;
+    Max = 0;
+}
+
+inline long long HISTOGRAM::GetCount() const
+{
+    return Count;
+}
+
+inline double HISTOGRAM::UpperEdge(int bucket)
+{
+    return MinValue() * pow(2.0, (double) bucket / BucketsPerDoubling);
+}
+
+inline double HISTOGRAM::GetQuantile(double q) const
+{
+    long long rank = (long long) ceil(q * Count), total = 0;
+    for (int i = 0; i < NumBuckets; i++)
+    {
+        total += Counts[i];
+        if (total > 0 && total >= rank)
+            return std::min(UpperEdge(i), Max);
+    }
+    return Max;
+}
+
+inline double HISTOGRAM::GetMax() const
+{
+    return Max;
+}
+
+inline void HISTOGRAM::Write(std::ostream& ostr) const
+{
+    ostr.write((const char*) &Counts[0], NumBuckets * sizeof(long long));
+    ostr.write((const char*) &Count, sizeof(Count));
+    ostr.write((const char*) &Max, sizeof(Max));
+}
+
+inline void HISTOGRAM::Read(std::istream& istr)
+{
+    istr.read((char*) &Counts[0], NumBuckets * sizeof(long long));
+    istr.read((char*) &Count, sizeof(Count));
+    istr.read((char*) &Max, sizeof(Max));
+}
+
 //----------------------------------------------------------------------------
 
 #endif // STATISTIC
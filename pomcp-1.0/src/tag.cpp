@@ -45,6 +45,12 @@ void TAG::FreeState(STATE* state) const
     MemoryPool.Free(tagstate);
 }
 
+void TAG::TrimMemory() const
+{
+    MemoryPool.Trim();
+    SIMULATOR::TrimMemory();
+}
+
 bool TAG::Step(STATE& state, int action, 
     int& observation, double& reward, STATUS& status) const
 {
@@ -166,7 +172,7 @@ void TAG::MoveOpponent(TAG_STATE& tagstate, int opp) const
     const COORD& agent = tagstate.AgentPos;
     COORD& opponent = tagstate.OpponentPos[opp];
     
-    static vector<int> actions;
+    static thread_local vector<int> actions;
     actions.clear();
 
     if (opponent.X >= agent.X)
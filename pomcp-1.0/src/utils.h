@@ -3,15 +3,12 @@
 
 #include <vector>
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 #include <assert.h>
 #include "coord.h"
 #include "memorypool.h"
 #include <algorithm>
-#include <boost/math/distributions/beta.hpp>
-#include <boost/math/distributions/gamma.hpp>
-#include <boost/random.hpp>
-#include <boost/random/normal_distribution.hpp>
 
 #define LargeInteger 1000000
 #define Infinity 1e+10
@@ -23,12 +20,6 @@
 #define safe_cast static_cast
 #endif
 
-/*boost::mt19937 rng;
-boost::normal_distribution<> nd100(100,1.0);
-boost::variate_generator<boost::mt19937&, boost::normal_distribution<> > vg100(rng,nd100);
-boost::normal_distribution<> ndm01(-0.1,1.0);
-boost::variate_generator<boost::mt19937&, boost::normal_distribution<> > vgm01(rng,ndm01);*/
-
 namespace UTILS
 {
 
@@ -37,61 +28,135 @@ inline int Sign(int x)
     return (x > 0) - (x < 0);
 }
 
+//-----------------------------------------------------------------------------
+// xoshiro256** generator. Every thread has its own, so parallel searches
+// draw numbers without contention, and a thread seeded with RandomSeed
+// repeats its sequence exactly whatever other threads are doing.
+
+class RANDOM_GENERATOR
+{
+public:
+
+    RANDOM_GENERATOR() { Seed(1, 0); }
+
+    // Each stream of a seed is a separate SplitMix64 expansion
+    void Seed(uint64_t seed, int stream)
+    {
+        uint64_t x = seed ^ (0x9e3779b97f4a7c15ULL * ((uint64_t) stream + 1));
+        for (int i = 0; i < 4; i++)
+            State[i] = SplitMix64(x);
+    }
+
+    uint64_t Next()
+    {
+        uint64_t result = Rotl(State[1] * 5, 7) * 9;
+        uint64_t t = State[1] << 17;
+        State[2] ^= State[0];
+        State[3] ^= State[1];
+        State[1] ^= State[2];
+        State[0] ^= State[3];
+        State[2] ^= t;
+        State[3] = Rotl(State[3], 45);
+        return result;
+    }
+
+private:
+
+    static uint64_t Rotl(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    static uint64_t SplitMix64(uint64_t& x)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t State[4];
+};
+
+inline RANDOM_GENERATOR& Generator()
+{
+    static thread_local RANDOM_GENERATOR generator;
+    return generator;
+}
+
 inline int Random(int max)
 {
-    return rand() % max;
+    // Lemire's multiply-shift, rejecting the few low products that would bias it
+    uint32_t bound = max;
+    uint64_t m = (Generator().Next() >> 32) * bound;
+    if ((uint32_t) m < bound)
+    {
+        uint32_t threshold = -bound % bound;
+        while ((uint32_t) m < threshold)
+            m = (Generator().Next() >> 32) * bound;
+    }
+    return m >> 32;
 }
 
 inline int Random(int min, int max)
 {
-    return rand() % (max - min) + min;
+    return Random(max - min) + min;
 }
 
 inline double RandomDouble(double min, double max)
 {
-    return (double) rand() / RAND_MAX * (max - min) + min;
+    // 53 random bits, uniform in [0, 1)
+    return (Generator().Next() >> 11) * (1.0 / 9007199254740992.0) * (max - min) + min;
 }
 
-inline void RandomSeed(int seed)
+// Seeds this thread's generator, with a separate stream per run or worker
+inline void RandomSeed(uint64_t seed, int stream = 0)
 {
-    srand(seed);
+    Generator().Seed(seed, stream);
 }
 
-inline bool Bernoulli(double p)
+// Draws a seed for another thread's stream
+inline uint64_t RandomBits()
 {
-    return rand() < p * RAND_MAX;
+    return Generator().Next();
 }
 
-inline bool Near(double x, double y, double tol)
+inline bool Bernoulli(double p)
 {
-    return fabs(x - y) <= tol;
+    return RandomDouble(0.0, 1.0) < p;
 }
 
-inline double Beta(double a, double b)
+template<class T>
+inline void RandomShuffle(std::vector<T>& vec)
 {
-    boost::math::beta_distribution<> beta(a,b);
-    return boost::math::quantile(beta, RandomDouble(0.0, 1.0));
+    for (int i = (int) vec.size() - 1; i > 0; i--)
+        std::swap(vec[i], vec[Random(i + 1)]);
 }
 
-inline double Gamma(double k, double theta)
+inline bool Near(double x, double y, double tol)
 {
-    boost::math::gamma_distribution<> gamma(k,theta);
-    return boost::math::quantile(gamma, RandomDouble(0.0, 1.0));
+    return fabs(x - y) <= tol;
 }
 
+// Ziggurat sampler, drawing from this thread's generator
+double StandardNormal();
+
 inline double Normal(double m, double s)
 {
-    /*std::mt19937 rng;
-    std::normal_distribution<> normal(m,s);
-    return normal(rng);*/
-    
-    boost::mt19937 rng;
-    boost::normal_distribution<> nd(m,s);
-    boost::variate_generator<boost::mt19937&, boost::normal_distribution<> > vg(rng,nd);
-    double d = vg();
-    return d;
+    return m + s * StandardNormal();
 }
 
+// Fills values with independent normal samples
+void Normal(std::vector<double>& values, double m, double s);
+
+// Marsaglia and Tsang's rejection sampler, with shape k and scale theta
+double Gamma(double k, double theta);
+void Gamma(std::vector<double>& values, double k, double theta);
+
+// Ratio of two Gamma samples
+double Beta(double a, double b);
+void Beta(std::vector<double>& values, double a, double b);
+
 inline bool CheckFlag(int flags, int bit) { return (flags & (1 << bit)) != 0; }
 
 inline void SetFlag(int& flags, int bit) { flags = (flags | (1 << bit)); }